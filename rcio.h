@@ -1,29 +1,310 @@
 #ifndef _RCIO_H
 #define _RCIO_H
 
+#include <linux/bitmap.h>
+#include <linux/hrtimer.h>
+#include <linux/kobject.h>
+#include <linux/ktime.h>
+#include <linux/list.h>
+#include <linux/miscdevice.h>
 #include <linux/mutex.h>
+#include <linux/preempt.h>
+#include <linux/rwsem.h>
+#include <linux/seq_file.h>
+#include <linux/spinlock.h>
+#include <linux/string.h>
+#include <linux/wait.h>
 
-struct rcio_state
+#include "rcio_uapi.h"
+
+#define RCIO_BATCH_MAX 8
+#define RCIO_SUBSYSTEMS_MAX 4
+#define RCIO_CACHE_PAGES 6
+#define RCIO_CACHE_PAGE_REGS 128
+
+/* most the modules can hold, IO may report fewer in PX4IO_PAGE_CONFIG */
+#define RCIO_ACTUATORS_MAX RCIO_PWM_CHANNELS
+#define RCIO_RC_INPUTS_MAX RCIO_TELEMETRY_RC_CHANNELS
+#define RCIO_ADC_INPUTS_MAX RCIO_TELEMETRY_ADC_CHANNELS
+
+struct rcio_state;
+
+/* per board data of the modules, only the module itself looks inside */
+struct rcio_adc;
+struct rcio_pwm;
+struct rcio_rcin;
+struct rcio_status;
+/* per CPU bus statistics, private to the core */
+struct rcio_stats;
+
+/* transaction classes in increasing priority */
+enum rcio_class {
+    RCIO_CLASS_CONFIG,
+    RCIO_CLASS_TELEMETRY,
+    RCIO_CLASS_RC_INPUT,
+    RCIO_CLASS_ACTUATOR,
+    RCIO_CLASS_COUNT,
+};
+
+struct rcio_transaction
+{
+    struct list_head node;
+
+    u8 page;
+    u8 offset;
+    u8 count;
+    bool write;
+    u16 *values;
+    int result;
+
+    enum rcio_class class;
+    /* latest completion time, 0 if there is none */
+    ktime_t deadline;
+
+    /* answered from the shadow cache without going on the bus, set by the core */
+    bool cached;
+    /* when it was submitted and when it went to the adapter, set by the core */
+    ktime_t queued;
+    ktime_t submitted;
+
+    /* called from the transport completion path, must not sleep */
+    void (*complete)(struct rcio_transaction *t);
+    void *context;
+};
+
+enum rcio_cache_policy {
+    RCIO_CACHE_VOLATILE,
+    RCIO_CACHE_CACHEABLE,
+};
+
+struct rcio_cache_page
+{
+    u8 page;
+    enum rcio_cache_policy policy;
+    u16 size;
+    /* registers below 32 that are commands rather than data */
+    u32 volatile_mask;
+    u16 values[RCIO_CACHE_PAGE_REGS];
+    DECLARE_BITMAP(valid, RCIO_CACHE_PAGE_REGS);
+    /* writes submitted but not completed yet */
+    u16 writes_pending[RCIO_CACHE_PAGE_REGS];
+};
+
+/* what IO reports in PX4IO_PAGE_CONFIG, clamped to the maxima above */
+struct rcio_config
+{
+    u16 protocol_version;
+    u16 actuator_count;
+    u16 rc_input_count;
+    u16 adc_input_count;
+    /* registers one transaction may carry */
+    u16 max_regs;
+};
+
+struct rcio_subsystem
 {
+    const char *name;
+    /* lower value runs first when several subsystems are due */
+    unsigned int priority;
+    u32 period_us;
+    /* kicks closer together than this wait for the interval to pass */
+    u32 min_interval_us;
+    bool (*update)(struct rcio_state *state);
+
+    /* scheduler bookkeeping */
     struct kobject *object;
+    ktime_t next;
+    /* last periodic run, and last run of any kind */
+    ktime_t last;
+    ktime_t ran;
+    bool kicked;
+    /* period_us changed, next is worked out again from last */
+    bool rescheduled;
+    s64 measured_period_ns;
+    s64 jitter_ns;
+};
+
+/*
+ * Brackets an update of one block of the telemetry page, one writer per
+ * block. Writers run in task context, and a writer preempted with an odd
+ * sequence would leave a higher priority reader on its CPU spinning, so
+ * the block is written with preemption off.
+ */
+static inline void rcio_telemetry_begin(__u32 *sequence)
+{
+    preempt_disable();
+    WRITE_ONCE(*sequence, *sequence + 1);
+    smp_wmb();
+}
+
+static inline void rcio_telemetry_end(__u32 *sequence)
+{
+    smp_wmb();
+    WRITE_ONCE(*sequence, *sequence + 1);
+    preempt_enable();
+}
+
+/*
+ * Copies a block the way mmap() users do. Nothing between begin and end
+ * sleeps or gets preempted, so readers only wait for a few stores and the
+ * worker never waits for a reader at all.
+ */
+static inline void rcio_telemetry_copy(const __u32 *sequence, void *copy, size_t size)
+{
+    __u32 seq;
+
+    do {
+        while ((seq = READ_ONCE(*sequence)) & 1)
+            cpu_relax();
+
+        smp_rmb();
+        memcpy(copy, sequence, size);
+        smp_rmb();
+    } while (READ_ONCE(*sequence) != seq);
+}
+
+/* the sequence leads every block, copy is a struct of the block's type */
+#define rcio_telemetry_snapshot(block, copy) \
+    rcio_telemetry_copy(&(block)->sequence, (copy), sizeof(*(copy)))
+
+/* latency histograms of the core and the modules, bucket n counts [2^n, 2^(n+1)) us */
+#define RCIO_HISTOGRAM_BUCKETS 16
+
+static inline unsigned int rcio_histogram_bucket(s64 us)
+{
+    if (us <= 0)
+        return 0;
+
+    return min_t(unsigned int, fls64(us) - 1, RCIO_HISTOGRAM_BUCKETS - 1);
+}
+
+static inline void rcio_histogram_show(struct seq_file *s, const unsigned long *counts)
+{
+    for (int i = 0; i < RCIO_HISTOGRAM_BUCKETS; i++) {
+        if (i == RCIO_HISTOGRAM_BUCKETS - 1)
+            seq_printf(s, "%6u+      us: %lu\n", 1u << i, counts[i]);
+        else
+            seq_printf(s, "%6u-%-6u us: %lu\n", i ? 1u << i : 0, (2u << i) - 1, counts[i]);
+    }
+}
+
+struct rcio_state
+{
+    /* /sys/kernel/<name>, its release frees the state */
+    struct kobject object;
+    /* "rcio" for the first board, "rcio1" and up for any further one */
+    int id;
+    char name[16];
+    int connected;
+
     struct rcio_adapter *adapter;
+    /* read before any module probes */
+    struct rcio_config config;
     int (*register_set)(struct rcio_state *state, u8 page, u8 offset, const u16 *values, u8 num_values);
     int (*register_get)(struct rcio_state *state, u8 page, u8 offset, u16 *values, u8 num_values);
     int (*register_set_byte)(struct rcio_state *state, u8 page, u8 offset, u16 value);
     u16 (*register_get_byte)(struct rcio_state *state, u8 page, u8 offset);
     int (*register_modify)(struct rcio_state *state, u8 page, u8 offset, u16 clearbits, u16 setbits);
+    int (*register_transfer)(struct rcio_state *state, struct rcio_transaction *transactions, size_t count);
+    /* queues transactions and returns at once, those of one class complete in order */
+    int (*register_submit)(struct rcio_state *state, struct rcio_transaction *transactions, size_t count);
+    /* period may be overridden by the "rcio,<name>-period-us" device property */
+    int (*register_subsystem)(struct rcio_state *state, struct rcio_subsystem *subsystem);
+    /* runs the subsystem as soon as min_interval_us allows, safe in atomic context */
+    void (*subsystem_kick)(struct rcio_state *state, struct rcio_subsystem *subsystem);
+    /*
+     * -EINVAL below min_interval_us or what IO keeps up with, applies without
+     * waiting out the old period. Sleeps, and fails like sched_setattr() when
+     * a deadline worker can't get a reservation for the new period.
+     */
+    int (*subsystem_set_period)(struct rcio_state *state, struct rcio_subsystem *subsystem, u32 period_us);
+    /* for whoever notices IO lost its registers, safe in atomic context */
+    void (*cache_invalidate)(struct rcio_state *state);
+
+    spinlock_t queue_lock;
+    struct list_head queue[RCIO_CLASS_COUNT];
+    struct rcio_transaction *in_flight[RCIO_BATCH_MAX];
+    size_t in_flight_count;
+    /* the part of in_flight that actually goes on the bus */
+    struct rcio_transaction *to_send[RCIO_BATCH_MAX];
+    size_t to_send_count;
+    wait_queue_head_t idle;
+
+    /* when the bus has to be free for the next actuator frame */
+    ktime_t actuator_release;
+    struct hrtimer release_timer;
+    ktime_t batch_start;
+    s64 transaction_ns;
+    unsigned long completed[RCIO_CLASS_COUNT];
+    unsigned long deadline_misses[RCIO_CLASS_COUNT];
+
+    struct rcio_cache_page cache[RCIO_CACHE_PAGES];
+    struct dentry *debugfs;
+
+    struct kobject *scheduler;
+    struct rcio_subsystem *subsystems[RCIO_SUBSYSTEMS_MAX];
+    size_t subsystem_count;
+    bool kicked;
+
+    struct task_struct *worker;
+    /* worker runs under SCHED_DEADLINE, its reservation follows subsystem_set_period() */
+    bool worker_reserved;
+    struct mutex period_lock;
+    /* running average and maximum of how late the worker woke up */
+    s64 wake_lateness_ns;
+    s64 wake_lateness_max_ns;
+    /* most worker cycles in a row in which no subsystem got anything out */
+    unsigned int longest_stall;
+    struct rcio_stats __percpu *stats;
+
+    /* one zeroed page, mapped read only by /dev/rcio users */
+    struct rcio_telemetry *telemetry;
+    wait_queue_head_t telemetry_wait;
+
+    struct miscdevice misc;
+    /* set under users once the board is gone, open files keep the state alive */
+    bool dead;
+    struct rw_semaphore users;
+
+    /* set by the module probes, freed along with the state */
+    struct rcio_adc *adc;
+    struct rcio_pwm *pwm;
+    struct rcio_rcin *rcin;
+    struct rcio_status *status;
 };
 
+/* sysfs callbacks of every module get the board kobject */
+static inline struct rcio_state *rcio_from_object(struct kobject *kobj)
+{
+    return container_of(kobj, struct rcio_state, object);
+}
+
+/* wakes /dev/rcio pollers after a block got new data */
+static inline void rcio_telemetry_notify(struct rcio_state *state)
+{
+    wake_up_interruptible(&state->telemetry_wait);
+}
+
 struct rcio_adapter {
     void *client;
     struct device *dev;
-    struct mutex lock;
+    /* set by rcio_probe() */
+    struct rcio_state *state;
 
-    int (*read)(struct rcio_adapter *state, u16 address, char *buffer, size_t length); 
-    int (*write)(struct rcio_adapter *state, u16 address, const char *buffer, size_t length); 
+    /*
+     * Starts a batch of transactions and returns without waiting. The
+     * adapter sets each result and calls rcio_complete() once the whole
+     * batch is done. Only one batch is ever outstanding.
+     *
+     * A result is the register count or, on failure, -EBADMSG for a
+     * reply that fails its CRC, -EINVAL if IO rejected the request, -EIO
+     * for a reply that doesn't belong to it, or the bus error.
+     */
+    int (*submit)(struct rcio_adapter *state, struct rcio_transaction **transactions, size_t count);
 };
 
 int rcio_probe(struct rcio_adapter *state);
 int rcio_remove(struct rcio_adapter *state);
+void rcio_complete(struct rcio_adapter *state);
 
 #endif /* _RCIO_H */
@@ -1,101 +1,462 @@
 #include <linux/delay.h>
 #include <linux/module.h>
+#include <linux/slab.h>
+#include <linux/irq_work.h>
+#include <linux/iio/iio.h>
+#include <linux/iio/buffer.h>
+#include <linux/iio/trigger.h>
+#include <linux/iio/trigger_consumer.h>
+#include <linux/iio/triggered_buffer.h>
 
 #include "rcio.h"
 #include "protocol.h"
 
-#define RCIO_ADC_CHANNELS_COUNT 6
+#define RCIO_ADC_CHANNELS_COUNT RCIO_ADC_INPUTS_MAX
+#define RCIO_ADC_MAX_RATE_HZ 1000
+/* scans waiting for the trigger handler, a power of two */
+#define RCIO_ADC_SCAN_RING 8
 
-struct rcio_state *rcio;
+bool rcio_adc_update(struct rcio_state *state);
+
+/* one full scan as pushed to the IIO buffer, timestamp 8-byte aligned */
+struct rcio_adc_scan {
+    u16 channels[RCIO_ADC_CHANNELS_COUNT];
+    s64 timestamp __aligned(8);
+};
 
-static u16 measurements[RCIO_ADC_CHANNELS_COUNT];
+struct rcio_adc {
+    struct rcio_state *rcio;
 
-bool rcio_adc_update(struct rcio_state *state);
+    /* completion path only, readers use the telemetry block */
+    u16 measurements[RCIO_ADC_CHANNELS_COUNT];
+    /* pollable, changes with every sample that differs from the last one */
+    unsigned int sample_count;
+    struct kernfs_node *sample_count_node;
+
+    struct rcio_subsystem subsystem;
+
+    struct iio_dev *iio;
+    struct iio_trigger *trigger;
+    struct irq_work trigger_work;
+    /* completions add at scan_head, the trigger handler takes from scan_tail */
+    spinlock_t scan_lock;
+    struct rcio_adc_scan scans[RCIO_ADC_SCAN_RING];
+    u32 scan_head;
+    u32 scan_tail;
+    /* oldest scans dropped because the handler fell a whole ring behind */
+    unsigned long scan_overruns;
+
+    /* the channels IO reports followed by the timestamp, filled in at probe */
+    struct iio_chan_spec iio_channels[RCIO_ADC_CHANNELS_COUNT + 1];
+    /* IO always returns all channels, the IIO core picks the enabled ones */
+    unsigned long iio_scan_masks[2];
+
+    u16 regs[RCIO_ADC_CHANNELS_COUNT];
+    struct rcio_transaction read;
+    bool busy;
+};
+
+struct adc_channel_attribute {
+    struct kobj_attribute attr;
+    int channel;
+};
+
+#define to_channel_attribute(a) container_of(a, struct adc_channel_attribute, attr)
+
+/* all channels of one sample, never half of an update */
+static void snapshot(struct rcio_state *state, struct rcio_telemetry_adc *copy)
+{
+    rcio_telemetry_snapshot(&state->telemetry->adc, copy);
+}
 
 static ssize_t channel_show(struct kobject *kobj, struct kobj_attribute *attr,
             char *buf)
 {
-    ssize_t channel = -1;
-
-    if (!strcmp(attr->attr.name, "ch0")) {
-        channel = measurements[0];
-    } else if (!strcmp(attr->attr.name, "ch1")) {
-        channel = measurements[1];
-    } else if (!strcmp(attr->attr.name, "ch2")) {
-        channel = measurements[2];
-    } else if (!strcmp(attr->attr.name, "ch3")) {
-        channel = measurements[3];
-    } else if (!strcmp(attr->attr.name, "ch4")) {
-        channel = measurements[4];
-    } else if (!strcmp(attr->attr.name, "ch5")) {
-        channel = measurements[5];
-    }
+    struct rcio_telemetry_adc copy;
 
-    if (channel < 0) {
-        return -EBUSY;
-    }
+    snapshot(rcio_from_object(kobj), &copy);
+
+    return sprintf(buf, "%d\n", copy.values[to_channel_attribute(attr)->channel]);
+}
+
+static ssize_t sample_count_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf)
+{
+    return sprintf(buf, "%u\n", READ_ONCE(rcio_from_object(kobj)->adc->sample_count));
+}
 
-    return sprintf(buf, "%d\n", channel);
+static ssize_t scan_overruns_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf)
+{
+    return sprintf(buf, "%lu\n", READ_ONCE(rcio_from_object(kobj)->adc->scan_overruns));
 }
 
-static struct kobj_attribute ch0_attribute = __ATTR(ch0, S_IRUGO, channel_show, NULL);
-static struct kobj_attribute ch1_attribute = __ATTR(ch1, S_IRUGO, channel_show, NULL);
-static struct kobj_attribute ch2_attribute = __ATTR(ch2, S_IRUGO, channel_show, NULL);
-static struct kobj_attribute ch3_attribute = __ATTR(ch3, S_IRUGO, channel_show, NULL);
-static struct kobj_attribute ch4_attribute = __ATTR(ch4, S_IRUGO, channel_show, NULL);
-static struct kobj_attribute ch5_attribute = __ATTR(ch5, S_IRUGO, channel_show, NULL);
+#define ADC_CHANNEL_ATTRIBUTE(_channel) \
+    static struct adc_channel_attribute ch##_channel##_attribute = { \
+        .attr = __ATTR(ch##_channel, S_IRUGO, channel_show, NULL), \
+        .channel = _channel, \
+    }
+
+ADC_CHANNEL_ATTRIBUTE(0);
+ADC_CHANNEL_ATTRIBUTE(1);
+ADC_CHANNEL_ATTRIBUTE(2);
+ADC_CHANNEL_ATTRIBUTE(3);
+ADC_CHANNEL_ATTRIBUTE(4);
+ADC_CHANNEL_ATTRIBUTE(5);
+static struct kobj_attribute sample_count_attribute = __ATTR(sample_count, S_IRUGO, sample_count_show, NULL);
+static struct kobj_attribute scan_overruns_attribute = __ATTR(scan_overruns, S_IRUGO, scan_overruns_show, NULL);
 
 static struct attribute *attrs[] = {
-    &ch0_attribute.attr,
-    &ch1_attribute.attr,
-    &ch2_attribute.attr,
-    &ch3_attribute.attr,
-    &ch4_attribute.attr,
-    &ch5_attribute.attr,
+    &ch0_attribute.attr.attr,
+    &ch1_attribute.attr.attr,
+    &ch2_attribute.attr.attr,
+    &ch3_attribute.attr.attr,
+    &ch4_attribute.attr.attr,
+    &ch5_attribute.attr.attr,
+    &sample_count_attribute.attr,
+    &scan_overruns_attribute.attr,
     NULL,
 };
 
+/* only the channels IO has, ch0 and up lead attrs[] */
+static umode_t channel_visible(struct kobject *kobj, struct attribute *attr, int n)
+{
+    if (n < RCIO_ADC_CHANNELS_COUNT && n >= rcio_from_object(kobj)->config.adc_input_count)
+        return 0;
+
+    return attr->mode;
+}
+
 static struct attribute_group attr_group = {
     .name = "adc",
     .attrs = attrs,
+    .is_visible = channel_visible,
 };
 
-unsigned long timeout;
+static void publish_telemetry(struct rcio_adc *adc)
+{
+    struct rcio_telemetry_adc *block = &adc->rcio->telemetry->adc;
+
+    rcio_telemetry_begin(&block->sequence);
+    block->timestamp_ns = ktime_get_ns();
+    memcpy(block->values, adc->measurements, sizeof(adc->measurements));
+    rcio_telemetry_end(&block->sequence);
+}
+
+static void adc_read_complete(struct rcio_transaction *t)
+{
+    struct rcio_adc *adc = t->context;
+    unsigned long flags;
+
+    /* every read is a scan for IIO, whether it changed or not */
+    if (t->result >= 0 && adc->trigger && iio_buffer_enabled(adc->iio)) {
+        struct rcio_adc_scan *scan;
+
+        spin_lock_irqsave(&adc->scan_lock, flags);
+
+        if (adc->scan_head - adc->scan_tail == RCIO_ADC_SCAN_RING) {
+            adc->scan_tail++;
+            WRITE_ONCE(adc->scan_overruns, adc->scan_overruns + 1);
+        }
+
+        scan = &adc->scans[adc->scan_head++ % RCIO_ADC_SCAN_RING];
+        memcpy(scan->channels, adc->regs, sizeof(scan->channels));
+        scan->timestamp = iio_get_time_ns(adc->iio);
+
+        spin_unlock_irqrestore(&adc->scan_lock, flags);
+
+        irq_work_queue(&adc->trigger_work);
+    }
+
+    if (t->result >= 0 && memcmp(adc->measurements, adc->regs, sizeof(adc->measurements))) {
+        memcpy(adc->measurements, adc->regs, sizeof(adc->measurements));
+        WRITE_ONCE(adc->sample_count, adc->sample_count + 1);
+
+        publish_telemetry(adc);
+        rcio_telemetry_notify(adc->rcio);
+
+        if (adc->sample_count_node)
+            sysfs_notify_dirent(adc->sample_count_node);
+    }
+
+    WRITE_ONCE(adc->busy, false);
+}
 
 bool rcio_adc_update(struct rcio_state *state)
 {
-    if (time_before(jiffies, timeout)) {
+    struct rcio_adc *adc = state->adc;
+
+    /* previous read still queued */
+    if (READ_ONCE(adc->busy)) {
         return false;
     }
 
-    if (state->register_get(state, PX4IO_PAGE_RAW_ADC_INPUT, 0, measurements, RCIO_ADC_CHANNELS_COUNT) < 0) {
+    adc->read = (struct rcio_transaction) {
+        .page = PX4IO_PAGE_RAW_ADC_INPUT, .offset = 0,
+        .count = state->config.adc_input_count, .write = false, .values = adc->regs,
+        .class = RCIO_CLASS_TELEMETRY,
+        .deadline = ktime_add_us(ktime_get(), adc->subsystem.period_us),
+        .complete = adc_read_complete,
+        .context = adc,
+    };
+
+    adc->busy = true;
+
+    if (state->register_submit(state, &adc->read, 1) < 0) {
+        adc->busy = false;
         return false;
     }
 
-    timeout = jiffies + HZ / 50; /* timeout in 0.05s */
     return true;
 }
 
+static const struct rcio_subsystem adc_subsystem = {
+    .name = "adc",
+    .priority = 2,
+    .period_us = 20000, /* 50 Hz */
+    .update = rcio_adc_update,
+};
+
+#define RCIO_ADC_IIO_CHANNEL(_index) { \
+    .type = IIO_VOLTAGE, \
+    .indexed = 1, \
+    .channel = _index, \
+    .info_mask_separate = BIT(IIO_CHAN_INFO_RAW), \
+    .info_mask_shared_by_all = BIT(IIO_CHAN_INFO_SAMP_FREQ), \
+    .scan_index = _index, \
+    .scan_type = { \
+        .sign = 'u', \
+        .realbits = 16, \
+        .storagebits = 16, \
+        .endianness = IIO_CPU, \
+    }, \
+}
+
+static int adc_iio_read_raw(struct iio_dev *indio_dev, struct iio_chan_spec const *chan,
+        int *val, int *val2, long mask)
+{
+    struct rcio_adc *adc = iio_device_get_drvdata(indio_dev);
+    struct rcio_telemetry_adc copy;
+
+    switch (mask) {
+    case IIO_CHAN_INFO_RAW:
+        snapshot(adc->rcio, &copy);
+        *val = copy.values[chan->channel];
+        return IIO_VAL_INT;
+    case IIO_CHAN_INFO_SAMP_FREQ:
+        *val = USEC_PER_SEC / READ_ONCE(adc->subsystem.period_us);
+        return IIO_VAL_INT;
+    default:
+        return -EINVAL;
+    }
+}
+
+/* the sampling frequency is the adc subsystem period, scheduler/adc/period_us */
+static int adc_iio_write_raw(struct iio_dev *indio_dev, struct iio_chan_spec const *chan,
+        int val, int val2, long mask)
+{
+    struct rcio_adc *adc = iio_device_get_drvdata(indio_dev);
+
+    if (mask != IIO_CHAN_INFO_SAMP_FREQ)
+        return -EINVAL;
+
+    if (val <= 0 || val > RCIO_ADC_MAX_RATE_HZ)
+        return -EINVAL;
+
+    return adc->rcio->subsystem_set_period(adc->rcio, &adc->subsystem, USEC_PER_SEC / val);
+}
+
+static const struct iio_info adc_iio_info = {
+    .driver_module = THIS_MODULE,
+    .read_raw = adc_iio_read_raw,
+    .write_raw = adc_iio_write_raw,
+};
+
+static const struct iio_trigger_ops adc_trigger_ops = {
+    .owner = THIS_MODULE,
+};
+
+/* iio_trigger_poll() wants hard interrupt context, completions may not be */
+static void adc_trigger_fire(struct irq_work *work)
+{
+    struct rcio_adc *adc = container_of(work, struct rcio_adc, trigger_work);
+
+    iio_trigger_poll(adc->trigger);
+}
+
+static irqreturn_t adc_trigger_handler(int irq, void *p)
+{
+    struct iio_poll_func *pf = p;
+    struct iio_dev *indio_dev = pf->indio_dev;
+    struct rcio_adc *adc = iio_device_get_drvdata(indio_dev);
+    struct rcio_adc_scan data;
+    unsigned long flags;
+
+    /* a poll that came while this ran is lost, so take every scan waiting */
+    for (;;) {
+        spin_lock_irqsave(&adc->scan_lock, flags);
+
+        if (adc->scan_tail == adc->scan_head) {
+            spin_unlock_irqrestore(&adc->scan_lock, flags);
+            break;
+        }
+
+        data = adc->scans[adc->scan_tail++ % RCIO_ADC_SCAN_RING];
+
+        spin_unlock_irqrestore(&adc->scan_lock, flags);
+
+        iio_push_to_buffers_with_timestamp(indio_dev, &data, data.timestamp);
+    }
+
+    iio_trigger_notify_done(indio_dev->trig);
+
+    return IRQ_HANDLED;
+}
+
+static int adc_iio_probe(struct rcio_adc *adc)
+{
+    struct rcio_state *state = adc->rcio;
+    struct iio_dev *indio_dev;
+    struct iio_trigger *trigger;
+    u16 count = state->config.adc_input_count;
+    int ret;
+
+    for (int i = 0; i < count; i++)
+        adc->iio_channels[i] = (struct iio_chan_spec) RCIO_ADC_IIO_CHANNEL(i);
+
+    adc->iio_channels[count] = (struct iio_chan_spec) IIO_CHAN_SOFT_TIMESTAMP(count);
+    adc->iio_scan_masks[0] = GENMASK(count - 1, 0);
+
+    indio_dev = iio_device_alloc(0);
+
+    if (indio_dev == NULL)
+        return -ENOMEM;
+
+    iio_device_set_drvdata(indio_dev, adc);
+    indio_dev->name = "rcio_adc";
+    indio_dev->dev.parent = state->adapter->dev;
+    indio_dev->info = &adc_iio_info;
+    indio_dev->modes = INDIO_DIRECT_MODE;
+    indio_dev->channels = adc->iio_channels;
+    indio_dev->num_channels = count + 1;
+    indio_dev->available_scan_masks = adc->iio_scan_masks;
+
+    trigger = iio_trigger_alloc("%s-dev%d", indio_dev->name, indio_dev->id);
+
+    if (trigger == NULL) {
+        ret = -ENOMEM;
+        goto errout_device;
+    }
+
+    trigger->dev.parent = state->adapter->dev;
+    trigger->ops = &adc_trigger_ops;
+    init_irq_work(&adc->trigger_work, adc_trigger_fire);
+
+    ret = iio_trigger_register(trigger);
+
+    if (ret < 0)
+        goto errout_trigger;
+
+    indio_dev->trig = iio_trigger_get(trigger);
+
+    ret = iio_triggered_buffer_setup(indio_dev, NULL, adc_trigger_handler, NULL);
+
+    if (ret < 0)
+        goto errout_registered;
+
+    ret = iio_device_register(indio_dev);
+
+    if (ret < 0)
+        goto errout_buffer;
+
+    /* scans go out from now on */
+    adc->iio = indio_dev;
+    adc->trigger = trigger;
+
+    return 0;
+
+errout_buffer:
+    iio_triggered_buffer_cleanup(indio_dev);
+errout_registered:
+    iio_trigger_unregister(trigger);
+errout_trigger:
+    iio_trigger_free(trigger);
+errout_device:
+    iio_device_free(indio_dev);
+    return ret;
+}
+
 
 int rcio_adc_probe(struct rcio_state *state)
 {
+    struct rcio_adc *adc;
     int ret;
 
-    rcio = state;
+    adc = kzalloc(sizeof(struct rcio_adc), GFP_KERNEL);
+
+    if (adc == NULL)
+        return -ENOMEM;
 
-    timeout = jiffies + HZ / 50; /* timeout in 0.05s */
+    /* freed along with the state */
+    state->adc = adc;
+    adc->rcio = state;
+    adc->subsystem = adc_subsystem;
+    spin_lock_init(&adc->scan_lock);
 
-    ret = sysfs_create_group(rcio->object, &attr_group);
+    ret = sysfs_create_group(&state->object, &attr_group);
 
     if (ret < 0) {
         printk(KERN_INFO "sysfs failed\n");
+    } else {
+        struct kernfs_node *group = sysfs_get_dirent(state->object.sd, "adc");
+
+        /* sysfs_notify() may sleep, the completion path needs the node up front */
+        if (group) {
+            adc->sample_count_node = sysfs_get_dirent(group, "sample_count");
+            sysfs_put(group);
+        }
+    }
+
+    if (adc_iio_probe(adc) < 0) {
+        pr_warn("[RCIO]: %s: ADC not registered with IIO\n", state->name);
     }
 
+    return state->register_subsystem(state, &adc->subsystem);
+}
+
+int rcio_adc_remove(struct rcio_state *state)
+{
+    struct rcio_adc *adc = state->adc;
+    struct iio_trigger *trigger;
+
+    if (adc == NULL)
+        return 0;
+
+    if (adc->sample_count_node) {
+        sysfs_put(adc->sample_count_node);
+        adc->sample_count_node = NULL;
+    }
+
+    if (adc->iio == NULL)
+        return 0;
+
+    trigger = adc->trigger;
+    adc->trigger = NULL;
+
+    iio_device_unregister(adc->iio);
+    iio_triggered_buffer_cleanup(adc->iio);
+
+    irq_work_sync(&adc->trigger_work);
+    iio_trigger_unregister(trigger);
+    iio_trigger_free(trigger);
+
+    iio_device_free(adc->iio);
+    adc->iio = NULL;
+
     return 0;
 }
 
 EXPORT_SYMBOL_GPL(rcio_adc_probe);
 EXPORT_SYMBOL_GPL(rcio_adc_update);
+EXPORT_SYMBOL_GPL(rcio_adc_remove);
 MODULE_AUTHOR("Georgii Staroselskii <georgii.staroselskii@emlid.com>");
 MODULE_DESCRIPTION("RCIO ADC driver");
 MODULE_LICENSE("GPL v2");
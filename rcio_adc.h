@@ -5,5 +5,6 @@
 
 int rcio_adc_probe(struct rcio_state* state);
 bool rcio_adc_update(struct rcio_state *state);
+int rcio_adc_remove(struct rcio_state *state);
 
 #endif
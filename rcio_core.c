@@ -6,19 +6,35 @@
 #include <linux/delay.h>
 #include <linux/sched.h>
 #include <linux/kthread.h>
+#include <linux/completion.h>
+#include <linux/hrtimer.h>
+#include <linux/property.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/miscdevice.h>
+#include <linux/fs.h>
+#include <linux/mm.h>
+#include <linux/poll.h>
+#include <linux/slab.h>
+#include <linux/idr.h>
+#include <linux/cpumask.h>
+#include <linux/percpu.h>
+#include <linux/compat.h>
 
 #include "rcio.h"
+#include "protocol.h"
 #include "rcio_adc.h"
 #include "rcio_pwm.h"
 #include "rcio_rcin.h"
 #include "rcio_status.h"
 
-static int connected;
+#define CREATE_TRACE_POINTS
+#include "rcio_trace.h"
 
 static ssize_t connected_show(struct kobject *kobj, struct kobj_attribute *attr,
             char *buf)
 {
-    return sprintf(buf, "%d\n", connected);
+    return sprintf(buf, "%d\n", rcio_from_object(kobj)->connected);
 }
 
 static ssize_t connected_store(struct kobject *kobj, struct kobj_attribute *attr,
@@ -26,7 +42,7 @@ static ssize_t connected_store(struct kobject *kobj, struct kobj_attribute *attr
 {
     int ret;
 
-    ret = kstrtoint(buf, 10, &connected);
+    ret = kstrtoint(buf, 10, &rcio_from_object(kobj)->connected);
     if (ret < 0)
         return ret;
 
@@ -48,170 +64,1763 @@ static struct attribute_group attr_group = {
 
 struct kobject *rcio_kobj;
 
+struct rcio_class_attribute {
+    struct kobj_attribute attr;
+    enum rcio_class class;
+};
+
+#define to_class_attribute(a) container_of(a, struct rcio_class_attribute, attr)
+
+static ssize_t completed_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf);
+static ssize_t deadline_misses_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf);
+
+#define RCIO_CLASS_ATTRIBUTES(_name, _class) \
+    static struct rcio_class_attribute _name##_completed_attribute = { \
+        .attr = __ATTR(_name##_completed, S_IRUGO, completed_show, NULL), \
+        .class = _class, \
+    }; \
+    static struct rcio_class_attribute _name##_deadline_misses_attribute = { \
+        .attr = __ATTR(_name##_deadline_misses, S_IRUGO, deadline_misses_show, NULL), \
+        .class = _class, \
+    }
+
+RCIO_CLASS_ATTRIBUTES(actuator, RCIO_CLASS_ACTUATOR);
+RCIO_CLASS_ATTRIBUTES(rc_input, RCIO_CLASS_RC_INPUT);
+RCIO_CLASS_ATTRIBUTES(telemetry, RCIO_CLASS_TELEMETRY);
+RCIO_CLASS_ATTRIBUTES(config, RCIO_CLASS_CONFIG);
+
+static struct attribute *transactions_attrs[] = {
+    &actuator_completed_attribute.attr.attr,
+    &actuator_deadline_misses_attribute.attr.attr,
+    &rc_input_completed_attribute.attr.attr,
+    &rc_input_deadline_misses_attribute.attr.attr,
+    &telemetry_completed_attribute.attr.attr,
+    &telemetry_deadline_misses_attribute.attr.attr,
+    &config_completed_attribute.attr.attr,
+    &config_deadline_misses_attribute.attr.attr,
+    NULL,
+};
+
+static struct attribute_group transactions_attr_group = {
+    .name = "transactions",
+    .attrs = transactions_attrs,
+};
+
+/* numbers the boards, the first one keeps the plain names */
+static DEFINE_IDA(rcio_ida);
+
+#define RCIO_SCHEDULER_SLACK_NS 50000
+
+static void dispatch(struct rcio_state *state);
+
+static bool shadow_cache = true;
+module_param(shadow_cache, bool, 0444);
+MODULE_PARM_DESC(shadow_cache, "Keep a copy of configuration pages to skip redundant reads and writes");
+
+static const struct {
+    u8 page;
+    enum rcio_cache_policy policy;
+    u16 size;
+    u32 volatile_mask;
+} cache_layout[RCIO_CACHE_PAGES] = {
+    /*
+     * Reboot, DSM bind, debug level, CRC and safety registers are commands.
+     * IO doesn't keep what it is given for features, arming and the PWM
+     * rates, it masks and clamps them and holds on to failsafe bits.
+     */
+    { PX4IO_PAGE_SETUP, RCIO_CACHE_CACHEABLE, PX4IO_P_SETUP_FORCE_SAFETY_ON + 1,
+        BIT(PX4IO_P_SETUP_FEATURES) | BIT(PX4IO_P_SETUP_ARMING) | BIT(PX4IO_P_SETUP_PWM_RATES) |
+        BIT(PX4IO_P_SETUP_PWM_DEFAULTRATE) | BIT(PX4IO_P_SETUP_PWM_ALTRATE) |
+        BIT(PX4IO_P_SETUP_DSM) | BIT(PX4IO_P_SETUP_SET_DEBUG) | BIT(PX4IO_P_SETUP_REBOOT_BL) |
+        BIT(PX4IO_P_SETUP_CRC) | BIT(PX4IO_P_SETUP_CRC + 1) |
+        BIT(PX4IO_P_SETUP_FORCE_SAFETY_OFF) | BIT(PX4IO_P_SETUP_FORCE_SAFETY_ON) },
+    { PX4IO_PAGE_RC_CONFIG, RCIO_CACHE_CACHEABLE, RCIO_RC_INPUTS_MAX * PX4IO_P_RC_CONFIG_STRIDE, 0 },
+    { PX4IO_PAGE_FAILSAFE_PWM, RCIO_CACHE_CACHEABLE, 16, 0 },
+    { PX4IO_PAGE_CONTROL_MIN_PWM, RCIO_CACHE_CACHEABLE, 16, 0 },
+    { PX4IO_PAGE_CONTROL_MAX_PWM, RCIO_CACHE_CACHEABLE, 16, 0 },
+    { PX4IO_PAGE_DISARMED_PWM, RCIO_CACHE_CACHEABLE, 16, 0 },
+};
+
+static void cache_init(struct rcio_state *state)
+{
+    for (int i = 0; i < RCIO_CACHE_PAGES; i++) {
+        struct rcio_cache_page *page = &state->cache[i];
+
+        page->page = cache_layout[i].page;
+        page->policy = cache_layout[i].policy;
+        page->size = cache_layout[i].size;
+        page->volatile_mask = cache_layout[i].volatile_mask;
+        bitmap_zero(page->valid, RCIO_CACHE_PAGE_REGS);
+        memset(page->writes_pending, 0, sizeof(page->writes_pending));
+    }
+}
+
+/* IO restarted or was told to, nothing it held before can be trusted */
+static void cache_forget(struct rcio_state *state)
+{
+    for (int i = 0; i < RCIO_CACHE_PAGES; i++)
+        bitmap_zero(state->cache[i].valid, RCIO_CACHE_PAGE_REGS);
+}
+
+static void cache_invalidate(struct rcio_state *state)
+{
+    unsigned long flags;
+
+    spin_lock_irqsave(&state->queue_lock, flags);
+    cache_forget(state);
+    spin_unlock_irqrestore(&state->queue_lock, flags);
+}
+
+static struct rcio_cache_page *cache_lookup(struct rcio_state *state, const struct rcio_transaction *t)
+{
+    if (!shadow_cache)
+        return NULL;
+
+    for (int i = 0; i < RCIO_CACHE_PAGES; i++) {
+        struct rcio_cache_page *page = &state->cache[i];
+
+        if (page->page != t->page || page->policy != RCIO_CACHE_CACHEABLE)
+            continue;
+
+        if (t->offset + t->count > page->size)
+            return NULL;
+
+        for (unsigned reg = t->offset; reg < t->offset + t->count && reg < 32; reg++) {
+            if (page->volatile_mask & BIT(reg))
+                return NULL;
+        }
+
+        return page;
+    }
+
+    return NULL;
+}
+
+/* from submission to completion, the shadow only learns what IO took in finish() */
+static void cache_track_write(struct rcio_state *state, struct rcio_transaction *t, int delta)
+{
+    struct rcio_cache_page *page;
+
+    if (!t->write)
+        return;
+
+    page = cache_lookup(state, t);
+
+    if (page == NULL)
+        return;
+
+    for (unsigned reg = t->offset; reg < t->offset + t->count; reg++)
+        page->writes_pending[reg] += delta;
+}
+
+/*
+ * Serves reads of known registers and drops writes that change nothing.
+ * Neither holds while another write to the same registers is queued or on
+ * the bus, the shadow doesn't have its value yet.
+ */
+static bool cache_answer(struct rcio_state *state, struct rcio_transaction *t)
+{
+    struct rcio_cache_page *page = cache_lookup(state, t);
+
+    if (page == NULL)
+        return false;
+
+    for (unsigned reg = t->offset; reg < t->offset + t->count; reg++) {
+        if (!test_bit(reg, page->valid))
+            return false;
+
+        if (page->writes_pending[reg] > (t->write ? 1 : 0))
+            return false;
+    }
+
+    if (t->write) {
+        if (memcmp(&page->values[t->offset], t->values, 2 * t->count))
+            return false;
+    } else {
+        memcpy(t->values, &page->values[t->offset], 2 * t->count);
+    }
+
+    t->result = t->count;
+
+    return true;
+}
+
+static void cache_update(struct rcio_state *state, struct rcio_transaction *t)
+{
+    struct rcio_cache_page *page = cache_lookup(state, t);
+
+    if (page == NULL)
+        return;
+
+    for (unsigned reg = t->offset; reg < t->offset + t->count; reg++) {
+        /* IO may or may not have taken a failed write, forget what we knew */
+        if (t->result < 0) {
+            clear_bit(reg, page->valid);
+        } else {
+            page->values[reg] = t->values[reg - t->offset];
+            set_bit(reg, page->valid);
+        }
+    }
+}
+
+static int cache_show(struct seq_file *s, void *data)
+{
+    struct rcio_state *state = s->private;
+    unsigned long flags;
+
+    spin_lock_irqsave(&state->queue_lock, flags);
+
+    for (int i = 0; i < RCIO_CACHE_PAGES; i++) {
+        struct rcio_cache_page *page = &state->cache[i];
+        unsigned reg;
+
+        seq_printf(s, "page %u: %s, %u registers\n", page->page,
+                page->policy == RCIO_CACHE_CACHEABLE ? "cacheable" : "volatile", page->size);
+
+        for_each_set_bit(reg, page->valid, page->size) {
+            seq_printf(s, "  %3u: 0x%04x\n", reg, page->values[reg]);
+        }
+    }
+
+    spin_unlock_irqrestore(&state->queue_lock, flags);
+
+    return 0;
+}
+
+/* PX4IO pages are all below 128 */
+#define RCIO_STATS_PAGES 128
+
+/* what a failed result says, see struct rcio_adapter */
+enum rcio_error {
+    RCIO_ERROR_CRC,
+    RCIO_ERROR_REJECTED,
+    RCIO_ERROR_PROTOCOL,
+    RCIO_ERROR_BUS,
+    RCIO_ERROR_COUNT,
+};
+
+static const char * const error_names[RCIO_ERROR_COUNT] = {
+    [RCIO_ERROR_CRC] = "crc",
+    [RCIO_ERROR_REJECTED] = "rejected",
+    [RCIO_ERROR_PROTOCOL] = "protocol",
+    [RCIO_ERROR_BUS] = "bus",
+};
+
+/* bumped with this_cpu ops on the hot paths, only debugfs adds them up */
+struct rcio_stats {
+    unsigned long transactions[RCIO_STATS_PAGES];
+    unsigned long bytes[RCIO_STATS_PAGES];
+    unsigned long cached;
+    unsigned long errors[RCIO_ERROR_COUNT];
+    /* from submission until the adapter got it, and from there to completion */
+    unsigned long queue_latency[RCIO_HISTOGRAM_BUCKETS];
+    unsigned long bus_latency[RCIO_HISTOGRAM_BUCKETS];
+    /* time the worker spends in one pass over the subsystems */
+    unsigned long cycle_latency[RCIO_HISTOGRAM_BUCKETS];
+    unsigned long cycles;
+    unsigned long cycles_without_update;
+};
+
+#define stats_sum(state, field) ({ \
+    unsigned long __sum = 0; \
+    int __cpu; \
+    for_each_possible_cpu(__cpu) \
+        __sum += per_cpu_ptr((state)->stats, __cpu)->field; \
+    __sum; \
+})
+
+static unsigned int stats_bucket(ktime_t elapsed)
+{
+    return rcio_histogram_bucket(ktime_to_us(elapsed));
+}
+
+static enum rcio_error stats_error(int result)
+{
+    switch (result) {
+    case -EBADMSG:
+        return RCIO_ERROR_CRC;
+    case -EINVAL:
+        return RCIO_ERROR_REJECTED;
+    case -EIO:
+        return RCIO_ERROR_PROTOCOL;
+    default:
+        return RCIO_ERROR_BUS;
+    }
+}
+
+static void stats_transaction(struct rcio_state *state, const struct rcio_transaction *t, ktime_t now)
+{
+    struct rcio_stats __percpu *stats = state->stats;
+
+    if (t->cached) {
+        this_cpu_inc(stats->cached);
+    } else if (t->page < RCIO_STATS_PAGES) {
+        this_cpu_inc(stats->transactions[t->page]);
+        this_cpu_add(stats->bytes[t->page], 2 * t->count);
+    }
+
+    if (t->result < 0)
+        this_cpu_inc(stats->errors[stats_error(t->result)]);
+
+    this_cpu_inc(stats->queue_latency[stats_bucket(ktime_sub(t->submitted, t->queued))]);
+
+    /* answered by the cache, never was on the bus */
+    if (!t->cached)
+        this_cpu_inc(stats->bus_latency[stats_bucket(ktime_sub(now, t->submitted))]);
+}
+
+static int pages_show(struct seq_file *s, void *data)
+{
+    struct rcio_state *state = s->private;
+
+    seq_puts(s, "page transactions bytes\n");
+
+    for (int page = 0; page < RCIO_STATS_PAGES; page++) {
+        unsigned long transactions = stats_sum(state, transactions[page]);
+
+        if (transactions)
+            seq_printf(s, "%4d %12lu %lu\n", page, transactions, stats_sum(state, bytes[page]));
+    }
+
+    seq_printf(s, "cached %lu\n", stats_sum(state, cached));
+
+    return 0;
+}
+
+static int errors_show(struct seq_file *s, void *data)
+{
+    struct rcio_state *state = s->private;
+
+    for (int i = 0; i < RCIO_ERROR_COUNT; i++)
+        seq_printf(s, "%s %lu\n", error_names[i], stats_sum(state, errors[i]));
+
+    return 0;
+}
+
+static int cycles_show(struct seq_file *s, void *data)
+{
+    struct rcio_state *state = s->private;
+
+    seq_printf(s, "cycles %lu\n", stats_sum(state, cycles));
+    seq_printf(s, "cycles_without_update %lu\n", stats_sum(state, cycles_without_update));
+    seq_printf(s, "longest_stall %u\n", READ_ONCE(state->longest_stall));
+
+    return 0;
+}
+
+#define RCIO_STATS_HISTOGRAM(_name) \
+    static int _name##_show(struct seq_file *s, void *data) \
+    { \
+        struct rcio_state *state = s->private; \
+        unsigned long counts[RCIO_HISTOGRAM_BUCKETS]; \
+        for (int i = 0; i < RCIO_HISTOGRAM_BUCKETS; i++) \
+            counts[i] = stats_sum(state, _name[i]); \
+        rcio_histogram_show(s, counts); \
+        return 0; \
+    }
+
+RCIO_STATS_HISTOGRAM(queue_latency);
+RCIO_STATS_HISTOGRAM(bus_latency);
+RCIO_STATS_HISTOGRAM(cycle_latency);
+
+#define RCIO_STATS_FILE(_name) \
+    static int _name##_open(struct inode *inode, struct file *file) \
+    { \
+        return single_open(file, _name##_show, inode->i_private); \
+    } \
+    static const struct file_operations _name##_fops = { \
+        .owner = THIS_MODULE, \
+        .open = _name##_open, \
+        .read = seq_read, \
+        .llseek = seq_lseek, \
+        .release = single_release, \
+    }
+
+RCIO_STATS_FILE(pages);
+RCIO_STATS_FILE(errors);
+RCIO_STATS_FILE(cycles);
+RCIO_STATS_FILE(queue_latency);
+RCIO_STATS_FILE(bus_latency);
+RCIO_STATS_FILE(cycle_latency);
+
+static void stats_debugfs(struct rcio_state *state)
+{
+    struct dentry *dir;
+
+    if (IS_ERR_OR_NULL(state->debugfs))
+        return;
+
+    dir = debugfs_create_dir("stats", state->debugfs);
+
+    debugfs_create_file("pages", S_IRUGO, dir, state, &pages_fops);
+    debugfs_create_file("errors", S_IRUGO, dir, state, &errors_fops);
+    debugfs_create_file("cycles", S_IRUGO, dir, state, &cycles_fops);
+    debugfs_create_file("queue_latency", S_IRUGO, dir, state, &queue_latency_fops);
+    debugfs_create_file("bus_latency", S_IRUGO, dir, state, &bus_latency_fops);
+    debugfs_create_file("cycle_latency", S_IRUGO, dir, state, &cycle_latency_fops);
+}
+
+static int cache_open(struct inode *inode, struct file *file)
+{
+    return single_open(file, cache_show, inode->i_private);
+}
+
+static const struct file_operations cache_fops = {
+    .owner = THIS_MODULE,
+    .open = cache_open,
+    .read = seq_read,
+    .llseek = seq_lseek,
+    .release = single_release,
+};
+
+static void account(struct rcio_state *state, struct rcio_transaction **batch, size_t count, ktime_t now)
+{
+    s64 per_transaction;
+
+    for (size_t i = 0; i < count; i++) {
+        struct rcio_transaction *t = batch[i];
+
+        state->completed[t->class]++;
+
+        if (ktime_to_ns(t->deadline) && ktime_after(now, t->deadline))
+            state->deadline_misses[t->class]++;
+
+        stats_transaction(state, t, now);
+    }
+
+    if (state->to_send_count == 0)
+        return;
+
+    per_transaction = ktime_to_ns(ktime_sub(now, state->batch_start)) / state->to_send_count;
+
+    /* bus time estimate used to keep the slot before the next actuator frame free */
+    if (state->transaction_ns == 0) {
+        state->transaction_ns = per_transaction;
+    } else {
+        state->transaction_ns += (per_transaction - state->transaction_ns) / 8;
+    }
+}
+
+static void finish(struct rcio_state *state, struct rcio_transaction **batch, size_t count)
+{
+    unsigned long flags;
+
+    account(state, batch, count, ktime_get());
+
+    spin_lock_irqsave(&state->queue_lock, flags);
+
+    for (size_t i = 0; i < count; i++) {
+        struct rcio_transaction *t = batch[i];
+
+        cache_track_write(state, t, -1);
+
+        if (!t->cached)
+            cache_update(state, t);
+
+        if (t->write && t->result >= 0 && t->page == PX4IO_PAGE_SETUP &&
+                t->offset <= PX4IO_P_SETUP_REBOOT_BL && t->offset + t->count > PX4IO_P_SETUP_REBOOT_BL)
+            cache_forget(state);
+    }
+
+    spin_unlock_irqrestore(&state->queue_lock, flags);
+
+    for (size_t i = 0; i < count; i++) {
+        if (batch[i]->complete)
+            batch[i]->complete(batch[i]);
+    }
+
+    spin_lock_irqsave(&state->queue_lock, flags);
+    state->in_flight_count = 0;
+    state->to_send_count = 0;
+    spin_unlock_irqrestore(&state->queue_lock, flags);
+
+    wake_up(&state->idle);
+
+    dispatch(state);
+}
+
+static bool queue_empty(struct rcio_state *state)
+{
+    for (int class = 0; class < RCIO_CLASS_COUNT; class++) {
+        if (!list_empty(&state->queue[class]))
+            return false;
+    }
+
+    return true;
+}
+
+/*
+ * The bus stays reserved for the frame due at actuator_release until the
+ * worker had time to wake up and the frame time to go out. Submitting the
+ * frame moves actuator_release on, and its completion dispatches whatever
+ * waited, so this only runs out when no frame came.
+ */
+static ktime_t actuator_slot_end(struct rcio_state *state)
+{
+    return ktime_add_ns(state->actuator_release, RCIO_SCHEDULER_SLACK_NS +
+            READ_ONCE(state->wake_lateness_ns) + state->transaction_ns);
+}
+
+/*
+ * Hands the most urgent queued transactions to the adapter unless a batch is
+ * already out. Actuator transactions always go first. Everything else only
+ * goes on the bus if it is expected to be done before the next actuator frame
+ * is released, so a slow read never pushes a PWM frame back.
+ */
+static void dispatch(struct rcio_state *state)
+{
+    struct rcio_transaction *t;
+    unsigned long flags;
+    size_t count = 0;
+    size_t to_send = 0;
+    ktime_t now;
+    ktime_t end;
+    ktime_t slot_end;
+    int ret;
+
+    spin_lock_irqsave(&state->queue_lock, flags);
+
+    if (state->in_flight_count > 0 || queue_empty(state)) {
+        spin_unlock_irqrestore(&state->queue_lock, flags);
+        return;
+    }
+
+    now = ktime_get();
+    end = now;
+    slot_end = actuator_slot_end(state);
+
+    for (int class = RCIO_CLASS_COUNT - 1; class >= 0 && count < RCIO_BATCH_MAX; class--) {
+        while (count < RCIO_BATCH_MAX && !list_empty(&state->queue[class])) {
+            t = list_first_entry(&state->queue[class], struct rcio_transaction, node);
+
+            /* no bus time needed, completes in order with the rest of the batch */
+            if (cache_answer(state, t)) {
+                t->cached = true;
+                list_del_init(&t->node);
+                state->in_flight[count++] = t;
+                continue;
+            }
+
+            end = ktime_add_ns(end, state->transaction_ns);
+
+            if (class != RCIO_CLASS_ACTUATOR &&
+                    ktime_after(slot_end, now) &&
+                    ktime_after(end, state->actuator_release)) {
+                goto out;
+            }
+
+            t->cached = false;
+            list_del_init(&t->node);
+            state->in_flight[count++] = t;
+            state->to_send[to_send++] = t;
+        }
+    }
+
+out:
+    if (count == 0) {
+        /* whatever is queued goes out behind the next actuator frame, or once its slot passed unused */
+        hrtimer_start(&state->release_timer, slot_end, HRTIMER_MODE_ABS);
+        spin_unlock_irqrestore(&state->queue_lock, flags);
+        return;
+    }
+
+    state->in_flight_count = count;
+    state->to_send_count = to_send;
+
+    spin_unlock_irqrestore(&state->queue_lock, flags);
+
+    /* queueing ends and bus time starts here, the batch is ours until it completes */
+    now = ktime_get();
+    state->batch_start = now;
+
+    for (size_t i = 0; i < count; i++)
+        state->in_flight[i]->submitted = now;
+
+    if (to_send == 0) {
+        finish(state, state->in_flight, count);
+        return;
+    }
+
+    ret = state->adapter->submit(state->adapter, state->to_send, to_send);
+
+    if (ret < 0) {
+        for (size_t i = 0; i < to_send; i++)
+            state->to_send[i]->result = ret;
+
+        finish(state, state->in_flight, count);
+    }
+}
+
+/* no actuator frame used its slot, let the deferred work go */
+static enum hrtimer_restart release_timer_expired(struct hrtimer *timer)
+{
+    struct rcio_state *state = container_of(timer, struct rcio_state, release_timer);
+
+    dispatch(state);
+
+    return HRTIMER_NORESTART;
+}
+
+/* earliest deadline first within a class, no deadline goes last */
+static void enqueue(struct rcio_state *state, struct rcio_transaction *t)
+{
+    struct list_head *queue = &state->queue[t->class];
+    struct rcio_transaction *pos;
+
+    if (ktime_to_ns(t->deadline)) {
+        list_for_each_entry(pos, queue, node) {
+            if (ktime_to_ns(pos->deadline) == 0 || ktime_after(pos->deadline, t->deadline)) {
+                list_add_tail(&t->node, &pos->node);
+                return;
+            }
+        }
+    }
+
+    list_add_tail(&t->node, queue);
+}
+
+static int register_submit(struct rcio_state *state, struct rcio_transaction *transactions, size_t count)
+{
+    unsigned long flags;
+    ktime_t now = ktime_get();
+
+    for (size_t i = 0; i < count; i++) {
+        if (transactions[i].count > state->config.max_regs || transactions[i].class >= RCIO_CLASS_COUNT)
+            return -EINVAL;
+    }
+
+    spin_lock_irqsave(&state->queue_lock, flags);
+
+    for (size_t i = 0; i < count; i++) {
+        struct rcio_transaction *t = &transactions[i];
+
+        t->result = -EINPROGRESS;
+        t->queued = now;
+        cache_track_write(state, t, 1);
+        enqueue(state, t);
+
+        /* an actuator frame is due again once its deadline has passed */
+        if (t->class == RCIO_CLASS_ACTUATOR && ktime_to_ns(t->deadline))
+            state->actuator_release = t->deadline;
+    }
+
+    spin_unlock_irqrestore(&state->queue_lock, flags);
+
+    dispatch(state);
+
+    return 0;
+}
+
+static ssize_t completed_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf)
+{
+    return sprintf(buf, "%lu\n", READ_ONCE(rcio_from_object(kobj)->completed[to_class_attribute(attr)->class]));
+}
+
+static ssize_t deadline_misses_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf)
+{
+    return sprintf(buf, "%lu\n", READ_ONCE(rcio_from_object(kobj)->deadline_misses[to_class_attribute(attr)->class]));
+}
+
+void rcio_complete(struct rcio_adapter *adapter)
+{
+    struct rcio_state *state = adapter->state;
+
+    finish(state, state->in_flight, state->in_flight_count);
+}
+
+struct rcio_sync {
+    atomic_t pending;
+    struct completion done;
+};
+
+static void sync_complete(struct rcio_transaction *t)
+{
+    struct rcio_sync *sync = t->context;
+
+    if (atomic_dec_and_test(&sync->pending))
+        complete(&sync->done);
+}
+
+static int register_transfer(struct rcio_state *state, struct rcio_transaction *transactions, size_t count)
+{
+    struct rcio_sync sync;
+    int ret;
+
+    if (count == 0)
+        return 0;
+
+    atomic_set(&sync.pending, count);
+    init_completion(&sync.done);
+
+    for (size_t i = 0; i < count; i++) {
+        transactions[i].complete = sync_complete;
+        transactions[i].context = &sync;
+    }
+
+    ret = register_submit(state, transactions, count);
+
+    if (ret < 0)
+        return ret;
+
+    wait_for_completion(&sync.done);
+
+    for (size_t i = 0; i < count; i++) {
+        if (transactions[i].result < 0)
+            return transactions[i].result;
+    }
+
+    return 0;
+}
+
 static int register_set(struct rcio_state *state, u8 page, u8 offset, const u16 *values, u8 num_values)
+{
+    struct rcio_transaction t = {
+        .page = page,
+        .offset = offset,
+        .count = num_values,
+        .write = true,
+        .values = (u16 *)values,
+    };
+    int ret;
+
+    ret = register_transfer(state, &t, 1);
+
+    return ret < 0 ? ret : t.result;
+}
+
+static int register_get(struct rcio_state *state, u8 page, u8 offset, u16 *values, u8 num_values)
+{
+    struct rcio_transaction t = {
+        .page = page,
+        .offset = offset,
+        .count = num_values,
+        .write = false,
+        .values = values,
+    };
+    int ret;
+
+    ret = register_transfer(state, &t, 1);
+
+    return ret < 0 ? ret : t.result;
+}
+
+static int register_set_byte(struct rcio_state *state, u8 page, u8 offset, u16 value)
+{
+    return register_set(state, page, offset, &value, 1);
+}
+
+static u16 register_get_byte(struct rcio_state *state, u8 page, u8 offset)
+{
+    u16 reg;
+    
+    register_get(state, page, offset, &reg, 1);
+
+    return reg;
+}
+
+/* with the shadow cache the read is free for configuration pages */
+static int register_modify(struct rcio_state *state, u8 page, u8 offset, u16 clearbits, u16 setbits)
 {
     int ret;
+    u16 value;
+
+    ret = register_get(state, page, offset, &value, 1);
+
+    if (ret < 0)
+        return ret;
+
+    value &= ~clearbits;
+    value |= setbits;
+
+    return register_set_byte(state, page, offset, value);
+}
+
+static char *worker_policy = "normal";
+module_param(worker_policy, charp, 0444);
+MODULE_PARM_DESC(worker_policy, "Scheduling class of the worker threads: normal, fifo or deadline");
+
+static int worker_priority = 50;
+module_param(worker_priority, int, 0444);
+MODULE_PARM_DESC(worker_priority, "SCHED_FIFO priority of the worker threads, 1 to 99");
+
+static unsigned int worker_runtime_us = 250;
+module_param(worker_runtime_us, uint, 0444);
+MODULE_PARM_DESC(worker_runtime_us, "SCHED_DEADLINE runtime the worker gets every period of the fastest subsystem");
+
+static char *worker_cpus;
+module_param(worker_cpus, charp, 0444);
+MODULE_PARM_DESC(worker_cpus, "CPUs the worker threads may run on as a list like 2-3, not with deadline");
+
+/* SCHED_DEADLINE reservation for the fastest subsystem as the periods are now, under period_lock */
+static int worker_reserve(struct rcio_state *state, struct task_struct *task)
+{
+    u64 period_ns = U64_MAX;
+    struct sched_attr attr = {
+        .size = sizeof(attr),
+        .sched_policy = SCHED_DEADLINE,
+        .sched_runtime = (u64)worker_runtime_us * NSEC_PER_USEC,
+    };
+
+    for (size_t i = 0; i < state->subsystem_count; i++)
+        period_ns = min_t(u64, period_ns, (u64)state->subsystems[i]->period_us * NSEC_PER_USEC);
+
+    if (state->subsystem_count == 0)
+        return -EINVAL;
+
+    attr.sched_deadline = period_ns;
+    attr.sched_period = period_ns;
+
+    return sched_setattr(task, &attr);
+}
+
+/* subsystem directories live in <board>/scheduler */
+static struct rcio_subsystem *to_subsystem(struct kobject *kobj)
+{
+    struct rcio_state *state = rcio_from_object(kobj->parent->parent);
+
+    for (size_t i = 0; i < state->subsystem_count; i++) {
+        if (state->subsystems[i]->object == kobj)
+            return state->subsystems[i];
+    }
+
+    return NULL;
+}
+
+static ssize_t period_us_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf)
+{
+    return sprintf(buf, "%u\n", READ_ONCE(to_subsystem(kobj)->period_us));
+}
+
+/* shortest period any subsystem gets, about what IO takes to answer one transaction */
+#define RCIO_PERIOD_MIN_US 250
+
+/* takes effect counted from the last periodic run, not after the old period ran out */
+static int subsystem_set_period(struct rcio_state *state, struct rcio_subsystem *subsystem, u32 period_us)
+{
+    struct task_struct *worker;
+    u32 old_period_us;
+    int ret;
+
+    if (period_us < max_t(u32, RCIO_PERIOD_MIN_US, READ_ONCE(subsystem->min_interval_us)))
+        return -EINVAL;
+
+    mutex_lock(&state->period_lock);
+
+    worker = state->worker;
+    old_period_us = subsystem->period_us;
+    WRITE_ONCE(subsystem->period_us, period_us);
+
+    /* the reservation has to follow the fastest period, or the change doesn't happen */
+    if (worker && state->worker_reserved) {
+        ret = worker_reserve(state, worker);
+
+        if (ret < 0) {
+            WRITE_ONCE(subsystem->period_us, old_period_us);
+            mutex_unlock(&state->period_lock);
+            return ret;
+        }
+    }
+
+    mutex_unlock(&state->period_lock);
+
+    smp_wmb();
+    WRITE_ONCE(subsystem->rescheduled, true);
+    WRITE_ONCE(state->kicked, true);
+
+    if (worker)
+        wake_up_process(worker);
+
+    return 0;
+}
+
+static ssize_t period_us_store(struct kobject *kobj, struct kobj_attribute *attr,
+             const char *buf, size_t count)
+{
+    u32 period_us;
+    int ret;
+
+    ret = kstrtou32(buf, 10, &period_us);
+    if (ret < 0)
+        return ret;
+
+    /* subsystem directories live in the board's scheduler directory */
+    ret = subsystem_set_period(rcio_from_object(kobj->parent->parent), to_subsystem(kobj), period_us);
+
+    return ret < 0 ? ret : count;
+}
+
+static ssize_t priority_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf)
+{
+    return sprintf(buf, "%u\n", to_subsystem(kobj)->priority);
+}
+
+static ssize_t measured_period_us_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf)
+{
+    return sprintf(buf, "%lld\n", READ_ONCE(to_subsystem(kobj)->measured_period_ns) / NSEC_PER_USEC);
+}
+
+static ssize_t jitter_us_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf)
+{
+    return sprintf(buf, "%lld\n", READ_ONCE(to_subsystem(kobj)->jitter_ns) / NSEC_PER_USEC);
+}
+
+static ssize_t min_interval_us_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf)
+{
+    return sprintf(buf, "%u\n", READ_ONCE(to_subsystem(kobj)->min_interval_us));
+}
+
+static ssize_t min_interval_us_store(struct kobject *kobj, struct kobj_attribute *attr,
+             const char *buf, size_t count)
+{
+    u32 min_interval_us;
+    int ret;
+
+    ret = kstrtou32(buf, 10, &min_interval_us);
+    if (ret < 0)
+        return ret;
+
+    WRITE_ONCE(to_subsystem(kobj)->min_interval_us, min_interval_us);
+
+    return count;
+}
+
+static struct kobj_attribute period_us_attribute = __ATTR_RW(period_us);
+static struct kobj_attribute min_interval_us_attribute = __ATTR_RW(min_interval_us);
+static struct kobj_attribute priority_attribute = __ATTR_RO(priority);
+static struct kobj_attribute measured_period_us_attribute = __ATTR_RO(measured_period_us);
+static struct kobj_attribute jitter_us_attribute = __ATTR_RO(jitter_us);
+
+static struct attribute *subsystem_attrs[] = {
+    &period_us_attribute.attr,
+    &min_interval_us_attribute.attr,
+    &priority_attribute.attr,
+    &measured_period_us_attribute.attr,
+    &jitter_us_attribute.attr,
+    NULL,
+};
+
+static struct attribute_group subsystem_attr_group = {
+    .attrs = subsystem_attrs,
+};
+
+static ssize_t wake_lateness_us_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf)
+{
+    return sprintf(buf, "%lld\n", READ_ONCE(rcio_from_object(kobj->parent)->wake_lateness_ns) / NSEC_PER_USEC);
+}
+
+static ssize_t wake_lateness_max_us_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf)
+{
+    return sprintf(buf, "%lld\n", READ_ONCE(rcio_from_object(kobj->parent)->wake_lateness_max_ns) / NSEC_PER_USEC);
+}
+
+/* any write starts a new maximum */
+static ssize_t wake_lateness_max_us_store(struct kobject *kobj, struct kobj_attribute *attr,
+             const char *buf, size_t count)
+{
+    WRITE_ONCE(rcio_from_object(kobj->parent)->wake_lateness_max_ns, 0);
+
+    return count;
+}
+
+static struct kobj_attribute wake_lateness_us_attribute = __ATTR_RO(wake_lateness_us);
+static struct kobj_attribute wake_lateness_max_us_attribute = __ATTR_RW(wake_lateness_max_us);
+
+static struct attribute *scheduler_attrs[] = {
+    &wake_lateness_us_attribute.attr,
+    &wake_lateness_max_us_attribute.attr,
+    NULL,
+};
+
+static struct attribute_group scheduler_attr_group = {
+    .attrs = scheduler_attrs,
+};
+
+static int register_subsystem(struct rcio_state *state, struct rcio_subsystem *subsystem)
+{
+    char property[32];
+    u32 period_us;
+    size_t i;
+
+    if (state->subsystem_count >= RCIO_SUBSYSTEMS_MAX)
+        return -ENOSPC;
 
-    ret = state->adapter->write(state->adapter, (page << 8) | offset, (void *)values, num_values);
+    snprintf(property, sizeof(property), "rcio,%s-period-us", subsystem->name);
 
-    return ret;
-}
+    if (device_property_read_u32(state->adapter->dev, property, &period_us) == 0 && period_us > 0)
+        subsystem->period_us = period_us;
 
-static int register_get(struct rcio_state *state, u8 page, u8 offset, u16 *values, u8 num_values)
-{
-    int ret;
+    subsystem->object = kobject_create_and_add(subsystem->name, state->scheduler);
 
-    ret = state->adapter->read(state->adapter, (page << 8) | offset, (void *)values, num_values);
+    if (subsystem->object == NULL)
+        return -ENOMEM;
 
-    return ret;
+    if (sysfs_create_group(subsystem->object, &subsystem_attr_group)) {
+        kobject_put(subsystem->object);
+        return -ENOMEM;
+    }
+
+    subsystem->last = ktime_set(0, 0);
+    subsystem->ran = ktime_set(0, 0);
+    subsystem->kicked = false;
+    subsystem->rescheduled = false;
+    subsystem->next = ktime_add_us(ktime_get(), subsystem->period_us);
+    subsystem->measured_period_ns = 0;
+    subsystem->jitter_ns = 0;
+
+    /* keep the table sorted by priority */
+    for (i = state->subsystem_count; i > 0 && state->subsystems[i - 1]->priority > subsystem->priority; i--)
+        state->subsystems[i] = state->subsystems[i - 1];
+
+    state->subsystems[i] = subsystem;
+    state->subsystem_count++;
+
+    return 0;
 }
 
-static int register_set_byte(struct rcio_state *state, u8 page, u8 offset, u16 value)
+static void subsystem_kick(struct rcio_state *state, struct rcio_subsystem *subsystem)
 {
-    return register_set(state, page, offset, &value, 1);
+    struct task_struct *worker = READ_ONCE(state->worker);
+
+    WRITE_ONCE(subsystem->kicked, true);
+    WRITE_ONCE(state->kicked, true);
+
+    /* implies a barrier, the worker sees both flags once it runs */
+    if (worker)
+        wake_up_process(worker);
 }
 
-static u16 register_get_byte(struct rcio_state *state, u8 page, u8 offset)
+/* when the subsystem wants to run next, a kick may bring that forward */
+static ktime_t subsystem_due(struct rcio_subsystem *subsystem)
 {
-    u16 reg;
-    
-    register_get(state, page, offset, &reg, 1);
+    ktime_t earliest;
 
-    return reg;
+    if (!READ_ONCE(subsystem->kicked))
+        return subsystem->next;
+
+    earliest = ktime_add_us(subsystem->ran, READ_ONCE(subsystem->min_interval_us));
+
+    return ktime_before(earliest, subsystem->next) ? earliest : subsystem->next;
 }
 
-static int register_modify(struct rcio_state *state, u8 page, u8 offset, u16 clearbits, u16 setbits)
+static bool run_subsystem(struct rcio_state *state, struct rcio_subsystem *subsystem, ktime_t now)
 {
-    int ret;
-    u16 value;
+    s64 period_ns = (s64)READ_ONCE(subsystem->period_us) * NSEC_PER_USEC;
+    bool periodic = !ktime_before(now, subsystem->next);
+    bool updated;
 
-    ret = register_get(state, page, offset, &value, 1);
+    /* a kick that lands during update() is kept for the next pass */
+    WRITE_ONCE(subsystem->kicked, false);
+    subsystem->ran = now;
 
-    if (ret < 0)
-        return ret;
+    trace_rcio_subsystem_start(state, subsystem, periodic);
+    updated = subsystem->update(state);
+    trace_rcio_subsystem_end(state, subsystem, updated);
 
-    value &= ~clearbits;
-    value |= setbits;
+    /* kicked runs leave the period and its statistics alone */
+    if (!periodic)
+        return updated;
 
-    return register_set_byte(state, page, offset, value);
+    if (ktime_to_ns(subsystem->last)) {
+        s64 measured = ktime_to_ns(ktime_sub(now, subsystem->last));
+        s64 deviation = abs(measured - period_ns);
+
+        /* running averages with a gain of 1/16, as RFC 3550 does for jitter */
+        if (subsystem->measured_period_ns == 0) {
+            WRITE_ONCE(subsystem->measured_period_ns, measured);
+        } else {
+            WRITE_ONCE(subsystem->measured_period_ns,
+                    subsystem->measured_period_ns + (measured - subsystem->measured_period_ns) / 16);
+        }
+
+        WRITE_ONCE(subsystem->jitter_ns, subsystem->jitter_ns + (deviation - subsystem->jitter_ns) / 16);
+    }
+
+    subsystem->last = now;
+
+    subsystem->next = ktime_add_ns(subsystem->next, period_ns);
+
+    /* fell behind by more than a period, don't try to catch up */
+    if (ktime_before(subsystem->next, now))
+        subsystem->next = ktime_add_ns(now, period_ns);
+
+    return updated;
 }
 
-struct rcio_state rcio_state;
+/* how late the worker woke up for the subsystem due first, timer slack included */
+static void account_lateness(struct rcio_state *state, ktime_t wakeup)
+{
+    s64 lateness = ktime_to_ns(ktime_sub(ktime_get(), wakeup));
+
+    if (lateness < 0)
+        return;
+
+    WRITE_ONCE(state->wake_lateness_ns, state->wake_lateness_ns + (lateness - state->wake_lateness_ns) / 16);
 
-struct task_struct *task;
+    if (lateness > state->wake_lateness_max_ns)
+        WRITE_ONCE(state->wake_lateness_max_ns, lateness);
+}
 
 int worker(void *data)
 {
     struct rcio_state *state = (struct rcio_state *) data;
     int fail_counter = 0;
-    bool pwm_updated = false;
-    bool adc_updated = false;
-    bool rcin_updated = false;
 
     while (!kthread_should_stop()) {
-        pwm_updated = rcio_pwm_update(state);
-        adc_updated = rcio_adc_update(state);
-        rcin_updated = rcio_rcin_update(state);
-        rcio_status_update(state);
+        ktime_t now = ktime_get();
+        ktime_t wakeup = ktime_set(KTIME_SEC_MAX, 0);
+        bool updated = false;
+
+        WRITE_ONCE(state->kicked, false);
+
+        /* modules only queue their transactions, results arrive through callbacks */
+        for (size_t i = 0; i < state->subsystem_count; i++) {
+            struct rcio_subsystem *subsystem = state->subsystems[i];
+            ktime_t due;
+
+            /* cleared first, a period set meanwhile gets picked up on the next pass */
+            if (READ_ONCE(subsystem->rescheduled)) {
+                WRITE_ONCE(subsystem->rescheduled, false);
+                smp_mb();
+                subsystem->next = ktime_add_us(ktime_to_ns(subsystem->last) ? subsystem->last : now,
+                        READ_ONCE(subsystem->period_us));
+            }
 
-        if (pwm_updated || adc_updated || rcin_updated) {
+            due = subsystem_due(subsystem);
+
+            if (!ktime_before(now, due)) {
+                updated |= run_subsystem(state, subsystem, now);
+                due = subsystem_due(subsystem);
+            }
+
+            if (ktime_before(due, wakeup))
+                wakeup = due;
+        }
+
+        trace_rcio_worker_cycle(state, updated, wakeup);
+
+        this_cpu_inc(state->stats->cycles);
+        this_cpu_inc(state->stats->cycle_latency[stats_bucket(ktime_sub(ktime_get(), now))]);
+
+        if (updated) {
             fail_counter = 0;
         } else {
             fail_counter++;
+            this_cpu_inc(state->stats->cycles_without_update);
+
+            if (fail_counter > state->longest_stall)
+                WRITE_ONCE(state->longest_stall, fail_counter);
+        }
+
+        set_current_state(TASK_INTERRUPTIBLE);
+
+        /* a kick after the scan above must not wait for the timeout */
+        if (!kthread_should_stop() && !READ_ONCE(state->kicked)) {
+            /* nonzero if a kick or kthread_stop() came first */
+            if (schedule_hrtimeout_range(&wakeup, RCIO_SCHEDULER_SLACK_NS, HRTIMER_MODE_ABS) == 0)
+                account_lateness(state, wakeup);
         }
 
-        usleep_range(1000, 1500);
+        __set_current_state(TASK_RUNNING);
     } 
 
     return 0;
 }
 
-static int rcio_init(struct rcio_adapter *adapter)
+/* puts a freshly created worker under the class and CPUs the parameters ask for */
+static int worker_setup(struct rcio_state *state, struct task_struct *task)
 {
-    int retval;
+    cpumask_var_t cpus;
+    int ret;
+
+    if (worker_cpus) {
+        if (!zalloc_cpumask_var(&cpus, GFP_KERNEL))
+            return -ENOMEM;
+
+        ret = cpulist_parse(worker_cpus, cpus);
+
+        if (ret == 0 && cpumask_empty(cpus))
+            ret = -EINVAL;
+
+        if (ret == 0)
+            ret = set_cpus_allowed_ptr(task, cpus);
 
-    rcio_state.object = kobject_create_and_add("rcio", kernel_kobj);
+        free_cpumask_var(cpus);
+
+        if (ret < 0)
+            return ret;
+    }
+
+    if (!strcmp(worker_policy, "fifo")) {
+        struct sched_param param = { .sched_priority = worker_priority };
+
+        if (worker_priority < 1 || worker_priority >= MAX_RT_PRIO)
+            return -EINVAL;
+
+        return sched_setscheduler(task, SCHED_FIFO, &param);
+    }
+
+    if (!strcmp(worker_policy, "deadline")) {
+        /* the kernel only takes deadline tasks that may run on every CPU */
+        if (worker_cpus)
+            return -EINVAL;
+
+        ret = worker_reserve(state, task);
+
+        if (ret == 0)
+            state->worker_reserved = true;
+
+        return ret;
+    }
+
+    return strcmp(worker_policy, "normal") ? -EINVAL : 0;
+}
+
+static u16 config_count(u16 reported, u16 fallback, u16 max)
+{
+    /* zero means IO doesn't say */
+    return reported ? min(reported, max) : fallback;
+}
+
+static void discover(struct rcio_state *state)
+{
+    u16 regs[PX4IO_P_CONFIG_ADC_INPUT_COUNT + 1];
+    struct rcio_config *config = &state->config;
+
+    /* what the driver assumed before IO was asked */
+    *config = (struct rcio_config) {
+        .protocol_version = 0,
+        .actuator_count = RCIO_ACTUATORS_MAX,
+        .rc_input_count = 8,
+        .adc_input_count = RCIO_ADC_INPUTS_MAX,
+        .max_regs = PKT_MAX_REGS,
+    };
+
+    if (register_get(state, PX4IO_PAGE_CONFIG, 0, regs, ARRAY_SIZE(regs)) < 0) {
+        pr_warn("[RCIO]: PX4IO_PAGE_CONFIG not readable, using defaults\n");
+        return;
+    }
+
+    config->protocol_version = regs[PX4IO_P_CONFIG_PROTOCOL_VERSION];
+    config->actuator_count = config_count(regs[PX4IO_P_CONFIG_ACTUATOR_COUNT], config->actuator_count, RCIO_ACTUATORS_MAX);
+    config->rc_input_count = config_count(regs[PX4IO_P_CONFIG_RC_INPUT_COUNT], config->rc_input_count, RCIO_RC_INPUTS_MAX);
+    config->adc_input_count = config_count(regs[PX4IO_P_CONFIG_ADC_INPUT_COUNT], config->adc_input_count, RCIO_ADC_INPUTS_MAX);
+
+    /* in bytes including the two byte header, as the PX4 px4io driver reads it, room for one register at least */
+    if (regs[PX4IO_P_CONFIG_MAX_TRANSFER] >= 2 + 2)
+        config->max_regs = min_t(u16, (regs[PX4IO_P_CONFIG_MAX_TRANSFER] - 2) / 2, PKT_MAX_REGS);
+
+    /* the modules move a whole frame in one transaction, register_submit() refuses bigger ones */
+    config->actuator_count = min(config->actuator_count, config->max_regs);
+    config->adc_input_count = min(config->adc_input_count, config->max_regs);
+    config->rc_input_count = config->max_regs > PX4IO_P_RAW_RC_BASE ?
+        min_t(u16, config->rc_input_count, config->max_regs - PX4IO_P_RAW_RC_BASE) : 0;
+
+    pr_info("[RCIO]: %s: protocol %u, %u outputs, %u RC inputs, %u ADC inputs, %u registers per transfer\n",
+            state->name, config->protocol_version, config->actuator_count, config->rc_input_count,
+            config->adc_input_count, config->max_regs);
+}
+
+/* per open file, the board, the block sequences read() last acknowledged and the read() position */
+struct rcio_reader {
+    struct rcio_state *state;
+    u32 rc_seen;
+    u32 adc_seen;
+    u32 rc_cursor;
+};
+
+static int rcio_dev_mmap(struct file *file, struct vm_area_struct *vma)
+{
+    struct rcio_reader *reader = file->private_data;
+
+    if (vma->vm_pgoff != 0 || vma->vm_end - vma->vm_start != PAGE_SIZE)
+        return -EINVAL;
+
+    if (vma->vm_flags & VM_WRITE)
+        return -EPERM;
+
+    vma->vm_flags &= ~VM_MAYWRITE;
+
+    /* holds a reference, the page outlives the device if still mapped */
+    return vm_insert_page(vma, vma->vm_start, virt_to_page(reader->state->telemetry));
+}
+
+/* frames copied per pass of read() */
+#define RCIO_READ_CHUNK 16
+
+static int rcio_dev_open(struct inode *inode, struct file *file)
+{
+    /* misc_open() runs this under misc_mtx, so the board can't go away meanwhile */
+    struct rcio_state *state = container_of(file->private_data, struct rcio_state, misc);
+    struct rcio_reader *reader;
+
+    reader = kzalloc(sizeof(*reader), GFP_KERNEL);
+
+    if (reader == NULL)
+        return -ENOMEM;
+
+    reader->state = state;
+    reader->rc_seen = READ_ONCE(state->telemetry->rc.sequence);
+    reader->adc_seen = READ_ONCE(state->telemetry->adc.sequence);
+    reader->rc_cursor = rcio_rcin_frame_head(state);
+
+    kobject_get(&state->object);
+
+    file->private_data = reader;
+
+    return nonseekable_open(inode, file);
+}
+
+static int rcio_dev_release(struct inode *inode, struct file *file)
+{
+    struct rcio_reader *reader = file->private_data;
+
+    kobject_put(&reader->state->object);
+    kfree(reader);
+
+    return 0;
+}
+
+/* the block got a completed update since read() last acknowledged it, poll() calls this more than once */
+static bool rcio_dev_changed(u32 seen, const u32 *sequence)
+{
+    u32 current_sequence = READ_ONCE(*sequence);
+
+    /* still being written, its end wakes us again */
+    return !(current_sequence & 1) && current_sequence != seen;
+}
+
+/* any read(), even one that returns no frames, clears POLLPRI */
+static void rcio_dev_acknowledge(struct rcio_reader *reader)
+{
+    struct rcio_telemetry *telemetry = reader->state->telemetry;
+
+    WRITE_ONCE(reader->rc_seen, READ_ONCE(telemetry->rc.sequence));
+    WRITE_ONCE(reader->adc_seen, READ_ONCE(telemetry->adc.sequence));
+}
+
+static ssize_t rcio_dev_read(struct file *file, char __user *buf, size_t count, loff_t *ppos)
+{
+    struct rcio_reader *reader = file->private_data;
+    struct rcio_state *state = reader->state;
+    size_t wanted = count / sizeof(struct rcio_rc_frame);
+    struct rcio_rc_frame *frames;
+    ssize_t done = 0;
+    int ret;
 
-    if (rcio_state.object == NULL) {
+    if (wanted == 0)
         return -EINVAL;
+
+    rcio_dev_acknowledge(reader);
+
+    if (!rcio_rcin_frames_pending(state, reader->rc_cursor)) {
+        if (READ_ONCE(state->dead))
+            return -ENODEV;
+
+        if (file->f_flags & O_NONBLOCK)
+            return -EAGAIN;
+
+        ret = wait_event_interruptible(state->telemetry_wait,
+                READ_ONCE(state->dead) || rcio_rcin_frames_pending(state, reader->rc_cursor));
+
+        if (ret < 0)
+            return ret;
+    }
+
+    frames = kmalloc_array(RCIO_READ_CHUNK, sizeof(*frames), GFP_KERNEL);
+
+    if (frames == NULL)
+        return -ENOMEM;
+
+    while (wanted > 0) {
+        size_t copied = rcio_rcin_read_frames(state, &reader->rc_cursor, frames,
+                min_t(size_t, wanted, RCIO_READ_CHUNK));
+
+        if (copied == 0)
+            break;
+
+        if (copy_to_user(buf + done, frames, copied * sizeof(*frames))) {
+            done = done ? done : -EFAULT;
+            break;
+        }
+
+        done += copied * sizeof(*frames);
+        wanted -= copied;
+    }
+
+    kfree(frames);
+
+    /* woken by the removal with nothing left to hand out */
+    return done ? done : -ENODEV;
+}
+
+static unsigned int rcio_dev_poll(struct file *file, poll_table *wait)
+{
+    struct rcio_reader *reader = file->private_data;
+    struct rcio_state *state = reader->state;
+    struct rcio_telemetry *telemetry = state->telemetry;
+    unsigned int mask = 0;
+
+    poll_wait(file, &state->telemetry_wait, wait);
+
+    /* only what read() hands out without blocking */
+    if (rcio_rcin_frames_pending(state, reader->rc_cursor))
+        mask |= POLLIN | POLLRDNORM;
+
+    if (rcio_dev_changed(READ_ONCE(reader->rc_seen), &telemetry->rc.sequence) ||
+            rcio_dev_changed(READ_ONCE(reader->adc_seen), &telemetry->adc.sequence))
+        mask |= POLLPRI;
+
+    if (READ_ONCE(state->dead))
+        mask |= POLLHUP;
+
+    return mask;
+}
+
+static long rcio_dev_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
+{
+    struct rcio_reader *reader = file->private_data;
+    struct rcio_state *state = reader->state;
+    struct rcio_pwm_values frame;
+    long ret;
+
+    switch (cmd) {
+    case RCIO_IOC_SET_PWM:
+        if (!(file->f_mode & FMODE_WRITE))
+            return -EBADF;
+
+        if (copy_from_user(&frame, (void __user *)arg, sizeof(frame)))
+            return -EFAULT;
+
+        if (frame.flags & ~RCIO_PWM_FRAME_FLUSH)
+            return -EINVAL;
+
+        /* the worker has to stay around until the frame is out */
+        down_read(&state->users);
+        ret = state->dead ? -ENODEV : rcio_pwm_set_frame(state, frame.values, frame.flags);
+        up_read(&state->users);
+
+        return ret;
+    default:
+        return -ENOTTY;
+    }
+}
+
+#ifdef CONFIG_COMPAT
+/* the payload has the same layout for 32 bit callers, only the pointer needs converting */
+static long rcio_dev_compat_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
+{
+    return rcio_dev_ioctl(file, cmd, (unsigned long)compat_ptr(arg));
+}
+#endif
+
+static const struct file_operations rcio_dev_fops = {
+    .owner = THIS_MODULE,
+    .open = rcio_dev_open,
+    .release = rcio_dev_release,
+    .read = rcio_dev_read,
+    .llseek = no_llseek,
+    .poll = rcio_dev_poll,
+    .mmap = rcio_dev_mmap,
+    .unlocked_ioctl = rcio_dev_ioctl,
+#ifdef CONFIG_COMPAT
+    .compat_ioctl = rcio_dev_compat_ioctl,
+#endif
+};
+
+/* the last reference may be an open file long after the board was removed */
+static void rcio_release(struct kobject *kobj)
+{
+    struct rcio_state *state = rcio_from_object(kobj);
+
+    kfree(state->adc);
+    kfree(state->pwm);
+    kfree(state->rcin);
+    kfree(state->status);
+
+    free_page((unsigned long)state->telemetry);
+    free_percpu(state->stats);
+
+    ida_simple_remove(&rcio_ida, state->id);
+
+    kfree(state);
+}
+
+static struct kobj_type rcio_ktype = {
+    .release = rcio_release,
+    .sysfs_ops = &kobj_sysfs_ops,
+};
+
+static void rcio_stop(struct rcio_state *state)
+{
+    for (size_t i = 0; i < state->subsystem_count; i++)
+        kobject_put(state->subsystems[i]->object);
+
+    state->subsystem_count = 0;
+
+    kobject_put(state->scheduler);
+    state->scheduler = NULL;
+
+    debugfs_remove_recursive(state->debugfs);
+    state->debugfs = NULL;
+}
+
+static int rcio_init(struct rcio_state *state, struct rcio_adapter *adapter)
+{
+    struct task_struct *task;
+    int retval;
+
+    state->telemetry = (struct rcio_telemetry *)get_zeroed_page(GFP_KERNEL);
+
+    if (state->telemetry == NULL) {
+        return -ENOMEM;
+    }
+
+    state->stats = alloc_percpu(struct rcio_stats);
+
+    if (state->stats == NULL) {
+        return -ENOMEM;
+    }
+
+    state->telemetry->version = RCIO_TELEMETRY_VERSION;
+    state->telemetry->size = sizeof(struct rcio_telemetry);
+
+    retval = kobject_add(&state->object, kernel_kobj, "%s", state->name);
+
+    if (retval) {
+        return retval;
+    }
+
+    retval = sysfs_create_group(&state->object, &attr_group);
+
+    if (retval) {
+        return retval;
     }
 
-    retval = sysfs_create_group(rcio_state.object, &attr_group);
+    retval = sysfs_create_group(&state->object, &transactions_attr_group);
 
     if (retval) {
-        goto errout_allocated;
+        return retval;
+    }
+
+    state->scheduler = kobject_create_and_add("scheduler", &state->object);
+
+    if (state->scheduler == NULL) {
+        return -ENOMEM;
+    }
+
+    retval = sysfs_create_group(state->scheduler, &scheduler_attr_group);
+
+    if (retval) {
+        return retval;
+    }
+
+    state->debugfs = debugfs_create_dir(state->name, NULL);
+    debugfs_create_file("cache", S_IRUGO, state->debugfs, state, &cache_fops);
+    stats_debugfs(state);
+
+    state->subsystem_count = 0;
+
+    /* rcio_complete() needs it for the very first transfer */
+    state->adapter = adapter;
+    adapter->state = state;
+
+    spin_lock_init(&state->queue_lock);
+    mutex_init(&state->period_lock);
+    init_waitqueue_head(&state->idle);
+    init_waitqueue_head(&state->telemetry_wait);
+    init_rwsem(&state->users);
+    state->in_flight_count = 0;
+    state->to_send_count = 0;
+    state->actuator_release = ktime_set(0, 0);
+    state->transaction_ns = 0;
+
+    cache_init(state);
+
+    hrtimer_init(&state->release_timer, CLOCK_MONOTONIC, HRTIMER_MODE_ABS);
+    state->release_timer.function = release_timer_expired;
+
+    for (int class = 0; class < RCIO_CLASS_COUNT; class++) {
+        INIT_LIST_HEAD(&state->queue[class]);
+        state->completed[class] = 0;
+        state->deadline_misses[class] = 0;
     }
 
-    rcio_state.adapter = adapter;
-    rcio_state.register_get = register_get;
-    rcio_state.register_set = register_set;
-    rcio_state.register_get_byte = register_get_byte;
-    rcio_state.register_set_byte = register_set_byte;
-    rcio_state.register_modify = register_modify;
+    state->register_get = register_get;
+    state->register_set = register_set;
+    state->register_get_byte = register_get_byte;
+    state->register_set_byte = register_set_byte;
+    state->register_modify = register_modify;
+    state->register_transfer = register_transfer;
+    state->register_submit = register_submit;
+    state->register_subsystem = register_subsystem;
+    state->subsystem_kick = subsystem_kick;
+    state->subsystem_set_period = subsystem_set_period;
+    state->cache_invalidate = cache_invalidate;
+    state->kicked = false;
+
+    discover(state);
 
-    if (rcio_adc_probe(&rcio_state) < 0) {
+    if (rcio_adc_probe(state) < 0) {
         goto errout_adc;
     }
 
-    if (rcio_pwm_probe(&rcio_state) < 0) {
-        goto errout_pwm;
+    if (rcio_pwm_probe(state) < 0) {
+        goto errout_adc;
+    }
+
+    if (rcio_rcin_probe(state) < 0) {
+        goto errout_rcin;
     }
 
-    if (rcio_rcin_probe(&rcio_state) < 0) {
+    if (rcio_status_probe(state) < 0) {
+        goto errout_rcin;
+    }
+
+    state->misc = (struct miscdevice) {
+        .minor = MISC_DYNAMIC_MINOR,
+        .name = state->name,
+        .fops = &rcio_dev_fops,
+        .parent = adapter->dev,
+        .mode = S_IRUGO | S_IWUSR,
+    };
+
+    if (misc_register(&state->misc) < 0) {
         goto errout_rcin;
     }
 
-    if (rcio_status_probe(&rcio_state) < 0) {
-        goto errout_status;
+    task = kthread_create(&worker, (void *)state, "%s_worker", state->name);
+
+    if (IS_ERR(task)) {
+        goto errout_misc;
+    }
+
+    /* a bad setting costs timing, not the outputs, period changes wait until the reservation is known */
+    mutex_lock(&state->period_lock);
+    retval = worker_setup(state, task);
+
+    if (retval < 0) {
+        pr_warn("[RCIO]: %s: worker_policy %s, worker_cpus %s not applied: %d\n",
+                state->name, worker_policy, worker_cpus ? worker_cpus : "all", retval);
     }
 
-    task = kthread_run(&worker, (void *)&rcio_state,"rcio_worker");
+    /* kicks may still come from pwm_ops until the chip is removed */
+    get_task_struct(task);
+    wake_up_process(task);
+
+    /* kicks only wake the worker once it runs */
+    WRITE_ONCE(state->worker, task);
+    mutex_unlock(&state->period_lock);
 
     return 0;
 
-errout_status:
+errout_misc:
+    misc_deregister(&state->misc);
 errout_rcin:
-errout_pwm:
+    rcio_rcin_remove(state);
+    rcio_pwm_remove(state);
 errout_adc:
-errout_allocated:
-    kobject_put(rcio_state.object);
+    rcio_adc_remove(state);
+    rcio_stop(state);
     return -EIO;
 }
 
-static void rcio_stop(void)
-{
-    kobject_put(rcio_state.object);
-}
-
 
 int rcio_probe(struct rcio_adapter *adapter)
 {
-    if (rcio_init(adapter) < 0) {
+    struct rcio_state *state;
+    int id;
+
+    state = kzalloc(sizeof(*state), GFP_KERNEL);
+
+    if (state == NULL) {
+        return -ENOMEM;
+    }
+
+    id = ida_simple_get(&rcio_ida, 0, 0, GFP_KERNEL);
+
+    if (id < 0) {
+        kfree(state);
+        return id;
+    }
+
+    state->id = id;
+
+    if (id == 0) {
+        strlcpy(state->name, "rcio", sizeof(state->name));
+    } else {
+        snprintf(state->name, sizeof(state->name), "rcio%d", id);
+    }
+
+    /* from here on rcio_release() cleans up */
+    kobject_init(&state->object, &rcio_ktype);
+
+    if (rcio_init(state, adapter) < 0) {
         goto errout_init;
     }
 
     return 0;
 
 errout_init:
+    adapter->state = NULL;
+    kobject_put(&state->object);
     return -EBUSY;
 }
 
+static bool rcio_idle(struct rcio_state *state)
+{
+    unsigned long flags;
+    bool idle;
+
+    spin_lock_irqsave(&state->queue_lock, flags);
+    idle = state->in_flight_count == 0 && queue_empty(state);
+    spin_unlock_irqrestore(&state->queue_lock, flags);
+
+    return idle;
+}
+
 int rcio_remove(struct rcio_adapter *adapter)
 {
+    struct rcio_state *state = adapter->state;
     int ret;
 
-    kthread_stop(task);
+    misc_deregister(&state->misc);
+
+    /* files still open fail from now on, a frame being flushed finishes first */
+    down_write(&state->users);
+    state->dead = true;
+    up_write(&state->users);
+
+    wake_up_interruptible_all(&state->telemetry_wait);
+
+    kthread_stop(state->worker);
+
+    /* let whatever the last worker cycle queued run to completion */
+    wait_event(state->idle, rcio_idle(state));
+    hrtimer_cancel(&state->release_timer);
+
+    ret = rcio_pwm_remove(state);
+
+    rcio_adc_remove(state);
+    rcio_rcin_remove(state);
+
+    put_task_struct(state->worker);
+    state->worker = NULL;
+
+    rcio_stop(state);
 
-    ret = rcio_pwm_remove(&rcio_state);
+    kobject_del(&state->object);
+    kobject_put(&state->object);
 
-    rcio_stop();
+    adapter->state = NULL;
 
     return ret;
 }
 
-EXPORT_SYMBOL_GPL(rcio_state);
 EXPORT_SYMBOL_GPL(rcio_probe);
 EXPORT_SYMBOL_GPL(rcio_remove);
+EXPORT_SYMBOL_GPL(rcio_complete);
+EXPORT_TRACEPOINT_SYMBOL_GPL(rcio_transaction_start);
+EXPORT_TRACEPOINT_SYMBOL_GPL(rcio_transaction_end);
 
 MODULE_LICENSE("GPL v2");
 MODULE_AUTHOR("Georgii Staroselskii <georgii.staroselskii@emlid.com>");
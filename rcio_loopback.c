@@ -0,0 +1,432 @@
+#include <linux/hrtimer.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
+#include <linux/module.h>
+#include <linux/platform_device.h>
+#include <linux/random.h>
+#include <linux/slab.h>
+#include <linux/spinlock.h>
+
+#include "rcio.h"
+#include "protocol.h"
+#include "rcio_loopback.h"
+
+/*
+ * Stands in for IO and the bus on machines without a Navio. Every board
+ * is a platform device created by this module, its registers live in
+ * memory and a batch completes from an hrtimer after the configured
+ * latency, so the core, the modules and /dev/rcio run as they would on
+ * the real thing.
+ */
+
+#define RCIO_LOOPBACK_BOARDS_MAX 4
+#define RCIO_LOOPBACK_PAGES 128
+#define RCIO_LOOPBACK_PAGE_REGS 128
+
+#define RCIO_LOOPBACK_ACTUATORS 14
+#define RCIO_LOOPBACK_RC_CHANNELS 16
+#define RCIO_LOOPBACK_ADC_CHANNELS 6
+
+static unsigned int boards = 1;
+module_param(boards, uint, 0444);
+MODULE_PARM_DESC(boards, "Simulated boards, up to 4");
+
+static unsigned int latency_us = 400;
+module_param(latency_us, uint, 0644);
+MODULE_PARM_DESC(latency_us, "Time one transaction spends on the simulated bus");
+
+static unsigned int latency_jitter_us = 50;
+module_param(latency_jitter_us, uint, 0644);
+MODULE_PARM_DESC(latency_jitter_us, "Random extra delay added to every batch");
+
+static unsigned int value_noise = 4;
+module_param(value_noise, uint, 0644);
+MODULE_PARM_DESC(value_noise, "Largest random deviation of RC and ADC samples");
+
+static unsigned int rc_frame_us = 14000;
+module_param(rc_frame_us, uint, 0644);
+MODULE_PARM_DESC(rc_frame_us, "Interval of simulated RC frames, 0 stops RC input");
+
+static struct platform_device *devices[RCIO_LOOPBACK_BOARDS_MAX];
+
+/* one per board, found from the adapter or the platform device */
+struct rcio_loopback {
+    struct rcio_adapter adapter;
+    struct platform_device *pdev;
+
+    struct hrtimer timer;
+    struct rcio_transaction **batch;
+    size_t batch_count;
+
+    ktime_t start;
+    bool safety_off;
+
+    /* rcio_loopback_fail(): the next fail_count transactions to fail_page end in fail_result */
+    spinlock_t fail_lock;
+    u8 fail_page;
+    int fail_result;
+    unsigned int fail_count;
+
+    /* whatever was last written, read back for every page not modelled below */
+    u16 regs[RCIO_LOOPBACK_PAGES][RCIO_LOOPBACK_PAGE_REGS];
+};
+
+static u16 noisy(u16 value)
+{
+    if (value_noise == 0)
+        return value;
+
+    return value + prandom_u32_max(2 * value_noise + 1) - value_noise;
+}
+
+static u16 read_config(struct rcio_loopback *lb, u8 reg)
+{
+    switch (reg) {
+    case PX4IO_P_CONFIG_PROTOCOL_VERSION:
+        return PX4IO_PROTOCOL_VERSION;
+    case PX4IO_P_CONFIG_MAX_TRANSFER:
+        return 2 + 2 * PKT_MAX_REGS;
+    case PX4IO_P_CONFIG_CONTROL_COUNT:
+        return PX4IO_PROTOCOL_MAX_CONTROL_COUNT;
+    case PX4IO_P_CONFIG_ACTUATOR_COUNT:
+        return RCIO_LOOPBACK_ACTUATORS;
+    case PX4IO_P_CONFIG_RC_INPUT_COUNT:
+        return RCIO_LOOPBACK_RC_CHANNELS;
+    case PX4IO_P_CONFIG_ADC_INPUT_COUNT:
+        return RCIO_LOOPBACK_ADC_CHANNELS;
+    default:
+        return 0;
+    }
+}
+
+static u16 read_status(struct rcio_loopback *lb, u8 reg)
+{
+    u16 flags = PX4IO_P_STATUS_FLAGS_INIT_OK | PX4IO_P_STATUS_FLAGS_FMU_OK |
+        PX4IO_P_STATUS_FLAGS_MIXER_OK | PX4IO_P_STATUS_FLAGS_ARM_SYNC;
+
+    switch (reg) {
+    case PX4IO_P_STATUS_FLAGS:
+        if (rc_frame_us)
+            flags |= PX4IO_P_STATUS_FLAGS_RC_OK | PX4IO_P_STATUS_FLAGS_RC_SBUS;
+        if (lb->safety_off)
+            flags |= PX4IO_P_STATUS_FLAGS_SAFETY_OFF | PX4IO_P_STATUS_FLAGS_OUTPUTS_ARMED;
+        return flags;
+    case PX4IO_P_STATUS_ALARMS:
+        return rc_frame_us ? 0 : PX4IO_P_STATUS_ALARMS_RC_LOST;
+    case PX4IO_P_STATUS_VSERVO:
+        return noisy(5000);
+    default:
+        return 0;
+    }
+}
+
+static u16 read_raw_rc(struct rcio_loopback *lb, u8 reg)
+{
+    if (rc_frame_us == 0)
+        return 0;
+
+    switch (reg) {
+    case PX4IO_P_RAW_RC_COUNT:
+        return RCIO_LOOPBACK_RC_CHANNELS;
+    case PX4IO_P_RAW_RC_FLAGS:
+        return PX4IO_P_RAW_RC_FLAGS_RC_OK | PX4IO_P_RAW_RC_FLAGS_MAPPING_OK;
+    case PX4IO_P_RAW_RC_NRSSI:
+        return 255;
+    case PX4IO_P_RAW_FRAME_COUNT:
+        return div_u64(ktime_us_delta(ktime_get(), lb->start), rc_frame_us);
+    case PX4IO_P_RAW_LOST_FRAME_COUNT:
+        return 0;
+    default:
+        if (reg < PX4IO_P_RAW_RC_BASE || reg >= PX4IO_P_RAW_RC_BASE + RCIO_LOOPBACK_RC_CHANNELS)
+            return 0;
+        return noisy(1500);
+    }
+}
+
+static u16 read_register(struct rcio_loopback *lb, u8 page, u8 reg)
+{
+    switch (page) {
+    case PX4IO_PAGE_CONFIG:
+        return read_config(lb, reg);
+    case PX4IO_PAGE_STATUS:
+        return read_status(lb, reg);
+    case PX4IO_PAGE_RAW_RC_INPUT:
+        return read_raw_rc(lb, reg);
+    case PX4IO_PAGE_RAW_ADC_INPUT:
+        return reg < RCIO_LOOPBACK_ADC_CHANNELS ? noisy(1024 + 256 * reg) : 0;
+    case PX4IO_PAGE_SERVOS:
+        return lb->regs[PX4IO_PAGE_DIRECT_PWM][reg];
+    default:
+        return lb->regs[page][reg];
+    }
+}
+
+/* returns what IO would, the register count or -EINVAL for an error reply */
+static int execute(struct rcio_loopback *lb, struct rcio_transaction *t)
+{
+    if (t->page >= RCIO_LOOPBACK_PAGES || t->count > PKT_MAX_REGS ||
+            t->offset + t->count > RCIO_LOOPBACK_PAGE_REGS)
+        return -EINVAL;
+
+    if (!t->write) {
+        for (unsigned i = 0; i < t->count; i++)
+            t->values[i] = read_register(lb, t->page, t->offset + i);
+
+        return t->count;
+    }
+
+    switch (t->page) {
+    case PX4IO_PAGE_CONFIG:
+    case PX4IO_PAGE_RAW_RC_INPUT:
+    case PX4IO_PAGE_RAW_ADC_INPUT:
+        return -EINVAL;
+    case PX4IO_PAGE_STATUS:
+        /* alarms clear on write, nothing else is writable */
+        if (t->offset != PX4IO_P_STATUS_ALARMS || t->count != 1)
+            return -EINVAL;
+        return t->count;
+    case PX4IO_PAGE_SETUP:
+        if (t->offset == PX4IO_P_SETUP_FORCE_SAFETY_OFF && t->count == 1) {
+            if (t->values[0] != PX4IO_FORCE_SAFETY_MAGIC)
+                return -EINVAL;
+            lb->safety_off = true;
+            return t->count;
+        }
+
+        if (t->offset == PX4IO_P_SETUP_FORCE_SAFETY_ON && t->count == 1) {
+            if (t->values[0] != PX4IO_FORCE_SAFETY_MAGIC)
+                return -EINVAL;
+            lb->safety_off = false;
+            return t->count;
+        }
+
+        /* comes back at once with every register cleared */
+        if (t->offset == PX4IO_P_SETUP_REBOOT_BL && t->count == 1) {
+            if (t->values[0] != PX4IO_REBOOT_BL_MAGIC)
+                return -EINVAL;
+            memset(lb->regs, 0, sizeof(lb->regs));
+            lb->safety_off = false;
+            return t->count;
+        }
+        break;
+    }
+
+    memcpy(&lb->regs[t->page][t->offset], t->values, t->count * sizeof(u16));
+
+    return t->count;
+}
+
+/* an injected failure leaves the registers alone, as a lost or garbled packet would */
+static bool injected_failure(struct rcio_loopback *lb, struct rcio_transaction *t)
+{
+    bool failed = false;
+
+    spin_lock(&lb->fail_lock);
+
+    if (lb->fail_count > 0 && lb->fail_page == t->page) {
+        lb->fail_count--;
+        t->result = lb->fail_result;
+        failed = true;
+    }
+
+    spin_unlock(&lb->fail_lock);
+
+    return failed;
+}
+
+static enum hrtimer_restart rcio_loopback_reply(struct hrtimer *timer)
+{
+    struct rcio_loopback *lb = container_of(timer, struct rcio_loopback, timer);
+
+    for (size_t i = 0; i < lb->batch_count; i++) {
+        if (!injected_failure(lb, lb->batch[i]))
+            lb->batch[i]->result = execute(lb, lb->batch[i]);
+    }
+
+    /* may submit the next batch and restart the timer from in here */
+    rcio_complete(&lb->adapter);
+
+    return HRTIMER_NORESTART;
+}
+
+static int rcio_loopback_submit(struct rcio_adapter *adapter, struct rcio_transaction **transactions, size_t count)
+{
+    struct rcio_loopback *lb = container_of(adapter, struct rcio_loopback, adapter);
+    u64 delay_us = (u64)count * latency_us;
+
+    if (latency_jitter_us)
+        delay_us += prandom_u32_max(latency_jitter_us + 1);
+
+    lb->batch = transactions;
+    lb->batch_count = count;
+
+    hrtimer_start(&lb->timer, ns_to_ktime(delay_us * NSEC_PER_USEC), HRTIMER_MODE_REL);
+
+    return 0;
+}
+
+static int rcio_loopback_probe(struct platform_device *pdev)
+{
+    struct rcio_loopback *lb;
+    int ret;
+
+    lb = kzalloc(sizeof(struct rcio_loopback), GFP_KERNEL);
+
+    if (lb == NULL)
+        return -ENOMEM;
+
+    lb->pdev = pdev;
+    lb->adapter.client = pdev;
+    lb->adapter.dev = &pdev->dev;
+    lb->adapter.submit = rcio_loopback_submit;
+    lb->start = ktime_get();
+    spin_lock_init(&lb->fail_lock);
+
+    hrtimer_init(&lb->timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+    lb->timer.function = rcio_loopback_reply;
+
+    ret = rcio_probe(&lb->adapter);
+
+    if (ret < 0) {
+        hrtimer_cancel(&lb->timer);
+        kfree(lb);
+        return ret;
+    }
+
+    platform_set_drvdata(pdev, lb);
+
+    return 0;
+}
+
+static int rcio_loopback_remove(struct platform_device *pdev)
+{
+    struct rcio_loopback *lb = platform_get_drvdata(pdev);
+    int ret = rcio_remove(&lb->adapter);
+
+    if (ret < 0) {
+        dev_err(&pdev->dev, "rcio_remove=%d", ret);
+        return ret;
+    }
+
+    hrtimer_cancel(&lb->timer);
+    kfree(lb);
+
+    return ret;
+}
+
+/* NULL unless the board was created and probed */
+struct rcio_state *rcio_loopback_state(unsigned int board)
+{
+    struct rcio_loopback *lb;
+
+    if (board >= RCIO_LOOPBACK_BOARDS_MAX || devices[board] == NULL)
+        return NULL;
+
+    lb = platform_get_drvdata(devices[board]);
+
+    return lb ? lb->adapter.state : NULL;
+}
+EXPORT_SYMBOL_GPL(rcio_loopback_state);
+
+static struct rcio_loopback *to_loopback(struct rcio_state *state)
+{
+    if (state->adapter->submit != rcio_loopback_submit)
+        return NULL;
+
+    return container_of(state->adapter, struct rcio_loopback, adapter);
+}
+
+/* what IO holds right now, bypassing the core and its cache */
+int rcio_loopback_register(struct rcio_state *state, u8 page, u8 offset)
+{
+    struct rcio_loopback *lb = to_loopback(state);
+
+    if (lb == NULL)
+        return -ENODEV;
+
+    if (page >= RCIO_LOOPBACK_PAGES || offset >= RCIO_LOOPBACK_PAGE_REGS)
+        return -EINVAL;
+
+    return READ_ONCE(lb->regs[page][offset]);
+}
+EXPORT_SYMBOL_GPL(rcio_loopback_register);
+
+/* the next count transactions to page complete with result instead of running */
+int rcio_loopback_fail(struct rcio_state *state, u8 page, int result, unsigned int count)
+{
+    struct rcio_loopback *lb = to_loopback(state);
+    unsigned long flags;
+
+    if (lb == NULL)
+        return -ENODEV;
+
+    spin_lock_irqsave(&lb->fail_lock, flags);
+    lb->fail_page = page;
+    lb->fail_result = result;
+    lb->fail_count = count;
+    spin_unlock_irqrestore(&lb->fail_lock, flags);
+
+    return 0;
+}
+EXPORT_SYMBOL_GPL(rcio_loopback_fail);
+
+static struct platform_driver rcio_loopback_driver = {
+    .driver = {
+        .name = "rcio_loopback",
+        .owner = THIS_MODULE,
+    },
+    .probe = rcio_loopback_probe,
+    .remove = rcio_loopback_remove,
+};
+
+static void rcio_loopback_unregister(void)
+{
+    for (int i = RCIO_LOOPBACK_BOARDS_MAX - 1; i >= 0; i--) {
+        if (devices[i] != NULL)
+            platform_device_unregister(devices[i]);
+        devices[i] = NULL;
+    }
+}
+
+static int __init rcio_loopback_init(void)
+{
+    int ret;
+
+    if (boards > RCIO_LOOPBACK_BOARDS_MAX) {
+        pr_err("[RCIO]: at most %d loopback boards\n", RCIO_LOOPBACK_BOARDS_MAX);
+        return -EINVAL;
+    }
+
+    ret = platform_driver_register(&rcio_loopback_driver);
+
+    if (ret < 0)
+        return ret;
+
+    for (unsigned i = 0; i < boards; i++) {
+        struct platform_device *pdev = platform_device_register_simple("rcio_loopback", i, NULL, 0);
+
+        if (IS_ERR(pdev)) {
+            ret = PTR_ERR(pdev);
+            pr_err("[RCIO]: could not create loopback board %u: %d\n", i, ret);
+            rcio_loopback_unregister();
+            platform_driver_unregister(&rcio_loopback_driver);
+            return ret;
+        }
+
+        devices[i] = pdev;
+    }
+
+    return 0;
+}
+
+static void __exit rcio_loopback_exit(void)
+{
+    rcio_loopback_unregister();
+    platform_driver_unregister(&rcio_loopback_driver);
+}
+
+module_init(rcio_loopback_init);
+module_exit(rcio_loopback_exit);
+
+MODULE_DESCRIPTION("RCIO loopback adapter simulating IO in memory");
+MODULE_LICENSE("GPL v2");
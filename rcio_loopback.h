@@ -0,0 +1,11 @@
+#ifndef _RCIO_LOOPBACK_H
+#define _RCIO_LOOPBACK_H
+
+#include "rcio.h"
+
+/* for rcio_test, the state functions only take boards of this module */
+struct rcio_state *rcio_loopback_state(unsigned int board);
+int rcio_loopback_register(struct rcio_state *state, u8 page, u8 offset);
+int rcio_loopback_fail(struct rcio_state *state, u8 page, int result, unsigned int count);
+
+#endif
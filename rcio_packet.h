@@ -0,0 +1,90 @@
+#ifndef _RCIO_PACKET_H
+#define _RCIO_PACKET_H
+
+#include "rcio.h"
+#include "protocol.h"
+
+/*
+ * IOPacket encoding shared by the SPI driver and rcio_test, which checks it
+ * without a bus.
+ */
+
+/* what the CRC of a reply said, replies that never got that far are unchecked */
+enum rcio_packet_crc {
+    RCIO_PACKET_CRC_UNCHECKED,
+    RCIO_PACKET_CRC_OK,
+    RCIO_PACKET_CRC_BAD,
+};
+
+/* the CRC is taken with the crc field itself zeroed */
+static inline void rcio_packet_sign(struct IOPacket *packet)
+{
+    packet->crc = 0;
+    packet->crc = crc_packet(packet);
+}
+
+/* IO firmware without short frame support wants the unused registers padded */
+static inline void rcio_packet_pack(struct IOPacket *packet, const struct rcio_transaction *t, bool full_frame)
+{
+    packet->count_code = t->count | (t->write ? PKT_CODE_WRITE : PKT_CODE_READ);
+    packet->page = t->page;
+    packet->offset = t->offset;
+
+    if (t->write) {
+        memcpy(&packet->regs[0], (void *)t->values, (2 * t->count));
+
+        if (full_frame) {
+            for (unsigned i = t->count; i < PKT_MAX_REGS; i++)
+                packet->regs[i] = 0x55aa;
+        }
+    }
+
+    rcio_packet_sign(packet);
+}
+
+/*
+ * Returns the register count, or -EBADMSG, -EINVAL or -EIO like a
+ * transaction result. crc_result may be NULL.
+ */
+static inline int rcio_packet_unpack(struct IOPacket *packet, struct rcio_transaction *t,
+        enum rcio_packet_crc *crc_result)
+{
+    uint8_t crc = packet->crc;
+    bool crc_ok;
+
+    packet->crc = 0;
+
+    /* a garbled count would make the CRC run past the packet */
+    if (PKT_COUNT(*packet) > PKT_MAX_REGS)
+        return -EBADMSG;
+
+    crc_ok = crc == crc_packet(packet);
+
+    if (crc_result)
+        *crc_result = crc_ok ? RCIO_PACKET_CRC_OK : RCIO_PACKET_CRC_BAD;
+
+    if (!crc_ok)
+        return -EBADMSG;
+
+    /* check result in packet */
+    if (PKT_CODE(*packet) == PKT_CODE_ERROR) {
+        /* IO didn't like it - no point retrying */
+        return -EINVAL;
+    }
+
+    if (t->write)
+        return t->count;
+
+    /* compare the received count with the expected count */
+    if (PKT_COUNT(*packet) != t->count) {
+        /* IO returned the wrong number of registers - no point retrying */
+        return -EIO;
+    }
+
+    /* copy back the result */
+    memcpy(t->values, &packet->regs[0], (2 * t->count));
+
+    return t->count;
+}
+
+#endif
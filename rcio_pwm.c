@@ -1,12 +1,15 @@
+#include <linux/debugfs.h>
 #include <linux/module.h>
 #include <linux/pwm.h>
+#include <linux/seqlock.h>
+#include <linux/seq_file.h>
 #include <linux/slab.h>
 
 #include "rcio.h"
 #include "protocol.h"
 
-struct rcio_state *rcio;
-struct rcio_pwm *pwm;
+#define CREATE_TRACE_POINTS
+#include "rcio_pwm_trace.h"
 
 struct pwm_output_rc_config {
     uint8_t channel;
@@ -27,11 +30,66 @@ static int rcio_pwm_config(struct pwm_chip *chip, struct pwm_device *pwm, int du
 static int rcio_pwm_request(struct pwm_chip *chip, struct pwm_device *pwm);
 static void rcio_pwm_free(struct pwm_chip *chip, struct pwm_device *pwm);
 
-static int rcio_pwm_create_sysfs_handle(void);
+static int rcio_pwm_create_sysfs_handle(struct rcio_pwm *pwm);
+
+#define RCIO_PWM_MAX_CHANNELS RCIO_PWM_CHANNELS
+#define RCIO_PWM_FLUSH_TIMEOUT_MS 100
+
+struct rcio_pwm_frame {
+    u16 values[RCIO_PWM_MAX_CHANNELS];
+    u16 alt_frequency;
+    u16 default_frequency;
+    bool armed;
+    /* counts publications */
+    u32 generation;
+};
+
+#define RCIO_PWM_INITIAL_FRAME { .alt_frequency = 50, .default_frequency = 50 }
 
 struct rcio_pwm {
     struct pwm_chip chip;
     struct rcio_state *rcio;
+
+    /*
+     * pwm_ops edit pending under pending_lock, the worker only ever sees
+     * published, which changes as a whole under published_seq
+     */
+    struct rcio_pwm_frame pending;
+    struct rcio_pwm_frame published;
+    spinlock_t pending_lock;
+    seqcount_t published_seq;
+
+    /* last frame handed to the bus, worker only */
+    struct rcio_pwm_frame applied;
+
+    /* publication generation that made it to IO, waited on by flushes */
+    u32 flushed_generation;
+    u32 frame_generation;
+    wait_queue_head_t flush_wait;
+
+    /* channels to resend because their write failed */
+    unsigned long dirty;
+
+    ktime_t last_full_frame;
+
+    /* first publication the worker has not picked up yet, in ns, 0 if none */
+    atomic64_t unsent_since;
+    s64 frame_since;
+
+    /* delay from pwm_ops to the frame being on IO */
+    unsigned long latency_histogram[RCIO_HISTOGRAM_BUCKETS];
+
+    /* what is on its way to IO, published may change while a frame is queued */
+    u16 frame[RCIO_PWM_MAX_CHANNELS];
+    u16 alt_rate;
+    u16 default_rate;
+    struct rcio_subsystem subsystem;
+
+    struct rcio_transaction frame_batch[3];
+    struct rcio_transaction *alt_rate_write;
+    struct rcio_transaction *default_rate_write;
+    struct rcio_transaction *frame_write;
+    bool frame_busy;
 };
 
 static const struct pwm_ops rcio_pwm_ops = {
@@ -48,49 +106,305 @@ static inline struct rcio_pwm *to_rcio_pwm(struct pwm_chip *chip)
     return container_of(chip, struct rcio_pwm, chip);
 }
 
-#define RCIO_PWM_MAX_CHANNELS 14
-static u16 values[RCIO_PWM_MAX_CHANNELS] = {0};
+static unsigned int keepalive_ms = 50;
+module_param(keepalive_ms, uint, 0644);
+MODULE_PARM_DESC(keepalive_ms, "Resend the whole frame at least this often so IO never flags FMU_LOST");
+
+static bool low_latency;
+module_param(low_latency, bool, 0644);
+MODULE_PARM_DESC(low_latency, "Send new duty values at once instead of on the next 1 kHz tick");
+
+static void publish(struct rcio_pwm *pwm)
+{
+    pwm->pending.generation++;
+
+    write_seqcount_begin(&pwm->published_seq);
+    pwm->published = pwm->pending;
+    write_seqcount_end(&pwm->published_seq);
+
+    atomic64_cmpxchg(&pwm->unsent_since, 0, ktime_to_ns(ktime_get()));
+
+    if (READ_ONCE(low_latency))
+        pwm->rcio->subsystem_kick(pwm->rcio, &pwm->subsystem);
+}
+
+static void mark_dirty(struct rcio_pwm *pwm, unsigned int first, unsigned int count)
+{
+    unsigned int channel;
+
+    for (channel = first; channel < first + count; channel++)
+        set_bit(channel, &pwm->dirty);
+}
+
+/* a channel is 0 or a pulse width IO accepts */
+static bool duty_valid(unsigned int duty_us)
+{
+    return duty_us == 0 || (duty_us >= RCIO_PWM_MIN_US && duty_us <= RCIO_PWM_MAX_US);
+}
+
+int rcio_pwm_set_frame(struct rcio_state *state, const u16 *values, u32 flags)
+{
+    struct rcio_pwm *pwm = state->pwm;
+    unsigned long irqflags;
+    u32 generation;
+    bool armed;
+    long ret;
+
+    for (int channel = 0; channel < RCIO_PWM_MAX_CHANNELS; channel++) {
+        if (!duty_valid(values[channel]))
+            return -EINVAL;
+    }
+
+    spin_lock_irqsave(&pwm->pending_lock, irqflags);
+
+    memcpy(pwm->pending.values, values, sizeof(pwm->pending.values));
+
+    publish(pwm);
+
+    generation = pwm->pending.generation;
+    armed = pwm->pending.armed;
+
+    spin_unlock_irqrestore(&pwm->pending_lock, irqflags);
+
+    if (!(flags & RCIO_PWM_FRAME_FLUSH))
+        return 0;
+
+    /* kept for when the outputs get armed, but nothing goes to IO until then */
+    if (!armed)
+        return -EAGAIN;
+
+    /* unchanged values wouldn't go out before the next keepalive */
+    mark_dirty(pwm, 0, state->config.actuator_count);
+    state->subsystem_kick(state, &pwm->subsystem);
+
+    ret = wait_event_interruptible_timeout(pwm->flush_wait,
+            (s32)(READ_ONCE(pwm->flushed_generation) - generation) >= 0,
+            msecs_to_jiffies(RCIO_PWM_FLUSH_TIMEOUT_MS));
+
+    if (ret < 0)
+        return ret;
+
+    return ret ? 0 : -ETIMEDOUT;
+}
+
+static void snapshot(struct rcio_pwm *pwm, struct rcio_pwm_frame *frame)
+{
+    unsigned int seq;
+
+    do {
+        seq = read_seqcount_begin(&pwm->published_seq);
+        *frame = pwm->published;
+    } while (read_seqcount_retry(&pwm->published_seq, seq));
+}
+
+static void account_latency(struct rcio_pwm *pwm, s64 since)
+{
+    pwm->latency_histogram[rcio_histogram_bucket((ktime_to_ns(ktime_get()) - since) / NSEC_PER_USEC)]++;
+}
+
+static void frame_complete(struct rcio_transaction *t)
+{
+    struct rcio_pwm *pwm = t->context;
+    struct rcio_transaction *frame_write = pwm->frame_write;
+
+    /* send the same channels again next time */
+    if (frame_write && frame_write->result < 0) {
+        mark_dirty(pwm, frame_write->offset, frame_write->count);
+    } else if (frame_write) {
+        if (pwm->frame_since) {
+            account_latency(pwm, pwm->frame_since);
+        }
+
+        /* only values IO took count as flushed, rate changes alone don't */
+        WRITE_ONCE(pwm->flushed_generation, pwm->frame_generation);
+        wake_up(&pwm->flush_wait);
+    }
+
+    if (pwm->alt_rate_write && pwm->alt_rate_write->result < 0) {
+        printk(KERN_INFO "alt_frequency not set\n");
+    }
+
+    if (pwm->default_rate_write && pwm->default_rate_write->result < 0) {
+        printk(KERN_INFO "default_frequency not set\n");
+    }
+
+    WRITE_ONCE(pwm->frame_busy, false);
+
+    /* values published while this frame was queued would wait for the tick */
+    if (READ_ONCE(low_latency) && atomic64_read(&pwm->unsent_since))
+        pwm->rcio->subsystem_kick(pwm->rcio, &pwm->subsystem);
+}
+
+static int latency_show(struct seq_file *s, void *data)
+{
+    struct rcio_pwm *pwm = s->private;
+    unsigned long counts[RCIO_HISTOGRAM_BUCKETS];
+
+    for (int i = 0; i < RCIO_HISTOGRAM_BUCKETS; i++)
+        counts[i] = READ_ONCE(pwm->latency_histogram[i]);
+
+    rcio_histogram_show(s, counts);
+
+    return 0;
+}
 
-static u16 alt_frequency = 50;
-static bool alt_frequency_updated = false;
-static u16 default_frequency = 50;
-static bool default_frequency_updated = false;
+static int latency_open(struct inode *inode, struct file *file)
+{
+    return single_open(file, latency_show, inode->i_private);
+}
 
-static bool armed = false;
+static const struct file_operations latency_fops = {
+    .owner = THIS_MODULE,
+    .open = latency_open,
+    .read = seq_read,
+    .llseek = seq_lseek,
+    .release = single_release,
+};
 
 bool rcio_pwm_update(struct rcio_state *state)
 {
-    if (alt_frequency_updated) {
-        if (state->register_set_byte(state, PX4IO_PAGE_SETUP, PX4IO_P_SETUP_PWM_ALTRATE, alt_frequency) < 0) {
-            printk(KERN_INFO "alt_frequency not set\n");
+    struct rcio_pwm *pwm = state->pwm;
+    /* the frame has to be on the wire before the next one is due */
+    ktime_t now = ktime_get();
+    ktime_t deadline = ktime_add_us(now, pwm->subsystem.period_us);
+    struct rcio_pwm_frame next;
+    unsigned long changed;
+    size_t count = 0;
+
+    /* previous frame still queued, published goes out with the next one */
+    if (READ_ONCE(pwm->frame_busy)) {
+        return false;
+    }
+
+    pwm->alt_rate_write = NULL;
+    pwm->default_rate_write = NULL;
+    pwm->frame_write = NULL;
+
+    /* anything published after this point is stamped again */
+    pwm->frame_since = atomic64_xchg(&pwm->unsent_since, 0);
+    snapshot(pwm, &next);
+
+    if (next.alt_frequency != pwm->applied.alt_frequency) {
+        pwm->alt_rate = next.alt_frequency;
+        pwm->alt_rate_write = &pwm->frame_batch[count++];
+        *pwm->alt_rate_write = (struct rcio_transaction) {
+            .page = PX4IO_PAGE_SETUP, .offset = PX4IO_P_SETUP_PWM_ALTRATE,
+            .count = 1, .write = true, .values = &pwm->alt_rate,
+            .class = RCIO_CLASS_ACTUATOR, .deadline = deadline,
+        };
+    }
+
+    if (next.default_frequency != pwm->applied.default_frequency) {
+        pwm->default_rate = next.default_frequency;
+        pwm->default_rate_write = &pwm->frame_batch[count++];
+        *pwm->default_rate_write = (struct rcio_transaction) {
+            .page = PX4IO_PAGE_SETUP, .offset = PX4IO_P_SETUP_PWM_DEFAULTRATE,
+            .count = 1, .write = true, .values = &pwm->default_rate,
+            .class = RCIO_CLASS_ACTUATOR, .deadline = deadline,
+        };
+    }
+
+    changed = xchg(&pwm->dirty, 0);
+
+    /* outputs IO doesn't have never go on the bus */
+    for (int channel = 0; channel < state->config.actuator_count; channel++) {
+        if (next.values[channel] != pwm->applied.values[channel]) {
+            __set_bit(channel, &changed);
         }
-        alt_frequency_updated = false;
     }
 
-    if (default_frequency_updated) {
-        if (state->register_set_byte(state, PX4IO_PAGE_SETUP, PX4IO_P_SETUP_PWM_DEFAULTRATE, default_frequency) < 0) {
-            printk(KERN_INFO "default_frequency not set\n");
+    if (next.armed) {
+        unsigned int first = 0;
+        unsigned int last = state->config.actuator_count - 1;
+        bool send = true;
+
+        if (!pwm->applied.armed) {
+            /* first frame after arming carries every channel */
+            pwm->last_full_frame = now;
+        } else if (ktime_us_delta(now, pwm->last_full_frame) >= (s64)READ_ONCE(keepalive_ms) * USEC_PER_MSEC) {
+            /* IO drops to failsafe if it hears nothing, refresh everything */
+            pwm->last_full_frame = now;
+        } else if (changed) {
+            /* smallest contiguous range that covers every change */
+            first = __ffs(changed);
+            last = __fls(changed);
+        } else {
+            send = false;
+        }
+
+        if (send) {
+            memcpy(&pwm->frame[first], &next.values[first], 2 * (last - first + 1));
+
+            pwm->frame_write = &pwm->frame_batch[count++];
+            *pwm->frame_write = (struct rcio_transaction) {
+                .page = PX4IO_PAGE_DIRECT_PWM, .offset = first,
+                .count = last - first + 1, .write = true, .values = &pwm->frame[first],
+                .class = RCIO_CLASS_ACTUATOR, .deadline = deadline,
+            };
         }
-        default_frequency_updated = false;
     }
 
-    if (armed) {
-        return state->register_set(state, PX4IO_PAGE_DIRECT_PWM, 0, values, RCIO_PWM_MAX_CHANNELS);
+    if (count == 0) {
+        pwm->applied = next;
+        return true;
+    }
+
+    pwm->frame_generation = next.generation;
+
+    /* rate changes and the frame go out back to back */
+    pwm->frame_batch[count - 1].complete = frame_complete;
+    pwm->frame_batch[count - 1].context = pwm;
+
+    pwm->frame_busy = true;
+
+    /* nothing went out, the same differences are found again next tick */
+    if (state->register_submit(state, pwm->frame_batch, count) < 0) {
+        pwm->frame_busy = false;
+        return false;
     }
 
+    pwm->applied = next;
+
     return true;
 }
 
+static const struct rcio_subsystem pwm_subsystem = {
+    .name = "pwm",
+    .priority = 0,
+    .period_us = 1000, /* 1 kHz */
+    .min_interval_us = 250, /* what IO keeps up with in low_latency mode */
+    .update = rcio_pwm_update,
+};
+
 static int rcio_pwm_safety_off(struct rcio_state *state)
 {
     return state->register_set_byte(state, PX4IO_PAGE_SETUP, PX4IO_P_SETUP_FORCE_SAFETY_OFF, PX4IO_FORCE_SAFETY_MAGIC);
 }
 
+static const struct rcio_pwm_frame initial_frame = RCIO_PWM_INITIAL_FRAME;
+
 int rcio_pwm_probe(struct rcio_state *state)
 {
+    struct rcio_pwm *pwm;
     int ret;
 
-    rcio = state;
+    pwm = kzalloc(sizeof(struct rcio_pwm), GFP_KERNEL);
+
+    if (!pwm)
+        return -ENOMEM;
+
+    /* freed along with the state */
+    state->pwm = pwm;
+    pwm->rcio = state;
+
+    pwm->pending = initial_frame;
+    pwm->published = initial_frame;
+    pwm->applied = initial_frame;
+    spin_lock_init(&pwm->pending_lock);
+    seqcount_init(&pwm->published_seq);
+    init_waitqueue_head(&pwm->flush_wait);
+    atomic64_set(&pwm->unsent_since, 0);
+    pwm->subsystem = pwm_subsystem;
 
     if (rcio_pwm_safety_off(state) < 0) {
         pr_err("SAFETY ON");
@@ -111,12 +425,12 @@ int rcio_pwm_probe(struct rcio_state *state)
         return -ENOTCONN;
     }
 
-    if (state->register_set_byte(state, PX4IO_PAGE_SETUP, PX4IO_P_SETUP_PWM_ALTRATE, alt_frequency) < 0) {
+    if (state->register_set_byte(state, PX4IO_PAGE_SETUP, PX4IO_P_SETUP_PWM_ALTRATE, pwm->applied.alt_frequency) < 0) {
         pr_err("alt_frequency not set");
         return -ENOTCONN;
     }   
 
-    if (state->register_set_byte(state, PX4IO_PAGE_SETUP, PX4IO_P_SETUP_PWM_DEFAULTRATE, default_frequency) < 0) {
+    if (state->register_set_byte(state, PX4IO_PAGE_SETUP, PX4IO_P_SETUP_PWM_DEFAULTRATE, pwm->applied.default_frequency) < 0) {
         pr_err("default_frequency not set");
         return -ENOTCONN;
     }   
@@ -126,55 +440,66 @@ int rcio_pwm_probe(struct rcio_state *state)
         return -EINVAL;
     }
 
-    ret = rcio_pwm_create_sysfs_handle();
+    ret = state->register_subsystem(state, &pwm->subsystem);
 
     if (ret < 0) {
-        pr_warn("Generic PWM interface for RCIO not created\n");
+        pr_err("PWM updates not scheduled");
         return ret;
     }
 
-    return 0;
-}
-
-int rcio_pwm_remove(struct rcio_state *state)
-{
-    int ret;
+    if (!IS_ERR_OR_NULL(state->debugfs))
+        debugfs_create_file("pwm_latency", S_IRUGO, state->debugfs, pwm, &latency_fops);
 
-    ret = pwmchip_remove(&pwm->chip);
+    ret = rcio_pwm_create_sysfs_handle(pwm);
 
-    if (ret < 0)
+    if (ret < 0) {
+        pr_warn("Generic PWM interface for RCIO not created\n");
         return ret;
-
-    kfree(pwm);    
+    }
 
     return 0;
 }
 
-static int rcio_pwm_create_sysfs_handle(void)
+int rcio_pwm_remove(struct rcio_state *state)
 {
-    pwm = kzalloc(sizeof(struct rcio_pwm), GFP_KERNEL);
-    
-    if (!pwm)
-        return -ENOMEM;
+    return pwmchip_remove(&state->pwm->chip);
+}
 
+static int rcio_pwm_create_sysfs_handle(struct rcio_pwm *pwm)
+{
     pwm->chip.ops = &rcio_pwm_ops;
-    pwm->chip.npwm = RCIO_PWM_MAX_CHANNELS;
+    pwm->chip.npwm = pwm->rcio->config.actuator_count;
     pwm->chip.can_sleep = false;
-    pwm->chip.dev = rcio->adapter->dev;
+    pwm->chip.dev = pwm->rcio->adapter->dev;
+    /* one chip per board, let the PWM core number them */
+    pwm->chip.base = -1;
 
     return pwmchip_add(&pwm->chip);
 }
 
+static void set_armed(struct rcio_pwm *handle, bool armed)
+{
+    unsigned long flags;
+
+    spin_lock_irqsave(&handle->pending_lock, flags);
+
+    handle->pending.armed = armed;
+
+    publish(handle);
+
+    spin_unlock_irqrestore(&handle->pending_lock, flags);
+}
+
 static int rcio_pwm_enable(struct pwm_chip *chip, struct pwm_device *pwm)
 {
-    armed = true;
+    set_armed(to_rcio_pwm(chip), true);
 
     return 0;
 }
 
 static void rcio_pwm_disable(struct pwm_chip *chip, struct pwm_device *pwm)
 {
-    armed = false;
+    set_armed(to_rcio_pwm(chip), false);
 }
 
 static int rcio_pwm_config(struct pwm_chip *chip, struct pwm_device *pwm, int duty_ns, int period_ns)
@@ -184,20 +509,26 @@ static int rcio_pwm_config(struct pwm_chip *chip, struct pwm_device *pwm, int du
     u16 duty_ms = duty_ns / 1000;
 
     u16 new_frequency = 1000000000 / period_ns;
+    unsigned long flags;
+
+    trace_rcio_pwm_config(handle->rcio, pwm->hwpwm, duty_ns, period_ns);
+
+    if (duty_ns < 0 || !duty_valid(duty_ns / 1000))
+        return -EINVAL;
+
+    spin_lock_irqsave(&handle->pending_lock, flags);
 
     if (pwm->hwpwm < 7) {
-        if (new_frequency != alt_frequency) {
-            alt_frequency = new_frequency;
-            alt_frequency_updated = true;
-        }
+        handle->pending.alt_frequency = new_frequency;
     } else {
-        if (new_frequency != default_frequency) {
-            default_frequency = new_frequency;
-            default_frequency_updated = true;
-        }
+        handle->pending.default_frequency = new_frequency;
     }
 
-    values[pwm->hwpwm] = duty_ms;
+    handle->pending.values[pwm->hwpwm] = duty_ms;
+
+    publish(handle);
+
+    spin_unlock_irqrestore(&handle->pending_lock, flags);
 
 //    printk(KERN_INFO "hwpwm=%d duty=%d period=%d duty_ms=%u freq=%u\n", pwm->hwpwm, duty_ns, period_ns, duty_ms, alt_frequency);
 
@@ -268,6 +599,7 @@ static int pwm_set_initial_rc_config(struct rcio_state *state)
 EXPORT_SYMBOL_GPL(rcio_pwm_probe);
 EXPORT_SYMBOL_GPL(rcio_pwm_remove);
 EXPORT_SYMBOL_GPL(rcio_pwm_update);
+EXPORT_SYMBOL_GPL(rcio_pwm_set_frame);
 MODULE_AUTHOR("Georgii Staroselskii <georgii.staroselskii@emlid.com>");
 MODULE_DESCRIPTION("RCIO PWM driver");
 MODULE_LICENSE("GPL v2");
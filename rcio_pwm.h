@@ -7,4 +7,6 @@ int rcio_pwm_probe(struct rcio_state* state);
 bool rcio_pwm_update(struct rcio_state *state);
 int rcio_pwm_remove(struct rcio_state *state);
 
+int rcio_pwm_set_frame(struct rcio_state *state, const u16 *values, u32 flags);
+
 #endif
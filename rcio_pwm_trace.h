@@ -0,0 +1,43 @@
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM rcio
+
+#if !defined(_RCIO_PWM_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _RCIO_PWM_TRACE_H
+
+#include <linux/tracepoint.h>
+
+#include "rcio.h"
+
+/* created in rcio_pwm.c, which can't use symbols of rcio_core */
+
+TRACE_EVENT(rcio_pwm_config,
+
+    TP_PROTO(const struct rcio_state *state, unsigned int hwpwm, int duty_ns, int period_ns),
+
+    TP_ARGS(state, hwpwm, duty_ns, period_ns),
+
+    TP_STRUCT__entry(
+        __string(board, state->name)
+        __field(unsigned int, hwpwm)
+        __field(int, duty_ns)
+        __field(int, period_ns)
+    ),
+
+    TP_fast_assign(
+        __assign_str(board, state->name);
+        __entry->hwpwm = hwpwm;
+        __entry->duty_ns = duty_ns;
+        __entry->period_ns = period_ns;
+    ),
+
+    TP_printk("%s hwpwm=%u duty_ns=%d period_ns=%d", __get_str(board),
+        __entry->hwpwm, __entry->duty_ns, __entry->period_ns)
+);
+
+#endif /* _RCIO_PWM_TRACE_H */
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE rcio_pwm_trace
+#include <trace/define_trace.h>
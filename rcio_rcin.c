@@ -1,146 +1,364 @@
 #include <linux/module.h>
+#include <linux/slab.h>
 
 #include "rcio.h"
 #include "protocol.h"
 #include "rcio_rcin_priv.h"
 
-#define RCIO_RCIN_MAX_CHANNELS 8
+#define RCIO_RCIN_MAX_CHANNELS RCIO_RC_INPUTS_MAX
 
-struct rcio_state *rcio;
+struct rcio_rcin {
+    struct rcio_state *rcio;
 
-static int rcin_get_raw_values(struct rcio_state *state, struct rc_input_values *rc_val);
+    /* completion path only, readers use the telemetry block */
+    u16 measurements[RCIO_RCIN_MAX_CHANNELS];
+    bool connected;
+    /* pollable, changes with every frame IO decodes */
+    u16 frame_count;
+    u16 lost_frame_count;
+    struct kernfs_node *frame_count_node;
 
-static u16 measurements[RCIO_RCIN_MAX_CHANNELS] = {0};
+    struct rcio_subsystem subsystem;
+
+    /* PX4IO_PAGE_RAW_RC_INPUT from the start, indexed by register */
+    uint16_t regs[PX4IO_P_RAW_RC_BASE + RCIO_RCIN_MAX_CHANNELS];
+    struct rc_input_values report;
+    struct rcio_transaction read;
+    bool busy;
+
+    /* every decoded frame, head counts frames ever stored */
+    struct rcio_rc_frame ring[RCIO_RC_RING_FRAMES];
+    u32 ring_head;
+    spinlock_t ring_lock;
+};
+
+static int rcin_get_raw_values(struct rcio_rcin *rcin, uint16_t rc_flags, uint16_t status, struct rc_input_values *rc_val);
+
+struct rcin_channel_attribute {
+    struct kobj_attribute attr;
+    int channel;
+};
+
+#define to_channel_attribute(a) container_of(a, struct rcin_channel_attribute, attr)
+
+/* channels, connection and counters of one frame, never half of an update */
+static void snapshot(struct kobject *kobj, struct rcio_telemetry_rc *copy)
+{
+    rcio_telemetry_snapshot(&rcio_from_object(kobj)->telemetry->rc, copy);
+}
 
 static ssize_t channel_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf)
 {
-    int value = -1;
-
-    if (!strcmp(attr->attr.name, "ch0")) {
-        value = measurements[0];
-    } else if (!strcmp(attr->attr.name, "ch1")) {
-        value = measurements[1];
-    } else if (!strcmp(attr->attr.name, "ch2")) {
-        value = measurements[2];
-    } else if (!strcmp(attr->attr.name, "ch3")) {
-        value = measurements[3];
-    } else if (!strcmp(attr->attr.name, "ch4")) {
-        value = measurements[4];
-    } else if (!strcmp(attr->attr.name, "ch5")) {
-        value = measurements[5];
-    } else if (!strcmp(attr->attr.name, "ch6")) {
-        value = measurements[6];
-    } else if (!strcmp(attr->attr.name, "ch7")) {
-        value = measurements[7];
-    }
+    struct rcio_telemetry_rc copy;
 
-    if (value < 0) {
-        return value;
-    }
+    snapshot(kobj, &copy);
 
-    return sprintf(buf, "%d\n", value);
+    return sprintf(buf, "%d\n", copy.values[to_channel_attribute(attr)->channel]);
 }
 
-static bool connected; 
 static ssize_t connected_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf)
 {
-    return sprintf(buf, "%d\n", connected? 1: 0);
+    struct rcio_telemetry_rc copy;
+
+    snapshot(kobj, &copy);
+
+    return sprintf(buf, "%d\n", copy.connected? 1: 0);
+}
+
+static ssize_t frame_count_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf)
+{
+    struct rcio_telemetry_rc copy;
+
+    snapshot(kobj, &copy);
+
+    return sprintf(buf, "%u\n", copy.frame_count);
 }
 
-static struct kobj_attribute ch0_attribute = __ATTR(ch0, S_IRUSR, channel_show, NULL);
-static struct kobj_attribute ch1_attribute = __ATTR(ch1, S_IRUSR, channel_show, NULL);
-static struct kobj_attribute ch2_attribute = __ATTR(ch2, S_IRUSR, channel_show, NULL);
-static struct kobj_attribute ch3_attribute = __ATTR(ch3, S_IRUSR, channel_show, NULL);
-static struct kobj_attribute ch4_attribute = __ATTR(ch4, S_IRUSR, channel_show, NULL);
-static struct kobj_attribute ch5_attribute = __ATTR(ch5, S_IRUSR, channel_show, NULL);
-static struct kobj_attribute ch6_attribute = __ATTR(ch6, S_IRUSR, channel_show, NULL);
-static struct kobj_attribute ch7_attribute = __ATTR(ch7, S_IRUSR, channel_show, NULL);
+#define RCIN_CHANNEL_ATTRIBUTE(_channel) \
+    static struct rcin_channel_attribute ch##_channel##_attribute = { \
+        .attr = __ATTR(ch##_channel, S_IRUSR, channel_show, NULL), \
+        .channel = _channel, \
+    }
+
+RCIN_CHANNEL_ATTRIBUTE(0);
+RCIN_CHANNEL_ATTRIBUTE(1);
+RCIN_CHANNEL_ATTRIBUTE(2);
+RCIN_CHANNEL_ATTRIBUTE(3);
+RCIN_CHANNEL_ATTRIBUTE(4);
+RCIN_CHANNEL_ATTRIBUTE(5);
+RCIN_CHANNEL_ATTRIBUTE(6);
+RCIN_CHANNEL_ATTRIBUTE(7);
+RCIN_CHANNEL_ATTRIBUTE(8);
+RCIN_CHANNEL_ATTRIBUTE(9);
+RCIN_CHANNEL_ATTRIBUTE(10);
+RCIN_CHANNEL_ATTRIBUTE(11);
+RCIN_CHANNEL_ATTRIBUTE(12);
+RCIN_CHANNEL_ATTRIBUTE(13);
+RCIN_CHANNEL_ATTRIBUTE(14);
+RCIN_CHANNEL_ATTRIBUTE(15);
+RCIN_CHANNEL_ATTRIBUTE(16);
+RCIN_CHANNEL_ATTRIBUTE(17);
+
 static struct kobj_attribute connected_attribute = __ATTR(connected, S_IRUSR, connected_show, NULL);
+static struct kobj_attribute frame_count_attribute = __ATTR(frame_count, S_IRUSR, frame_count_show, NULL);
 
 static struct attribute *attrs[] = {
-    &ch0_attribute.attr,
-    &ch1_attribute.attr,
-    &ch2_attribute.attr,
-    &ch3_attribute.attr,
-    &ch4_attribute.attr,
-    &ch5_attribute.attr,
-    &ch6_attribute.attr,
-    &ch7_attribute.attr,
+    &ch0_attribute.attr.attr,
+    &ch1_attribute.attr.attr,
+    &ch2_attribute.attr.attr,
+    &ch3_attribute.attr.attr,
+    &ch4_attribute.attr.attr,
+    &ch5_attribute.attr.attr,
+    &ch6_attribute.attr.attr,
+    &ch7_attribute.attr.attr,
+    &ch8_attribute.attr.attr,
+    &ch9_attribute.attr.attr,
+    &ch10_attribute.attr.attr,
+    &ch11_attribute.attr.attr,
+    &ch12_attribute.attr.attr,
+    &ch13_attribute.attr.attr,
+    &ch14_attribute.attr.attr,
+    &ch15_attribute.attr.attr,
+    &ch16_attribute.attr.attr,
+    &ch17_attribute.attr.attr,
     &connected_attribute.attr,
+    &frame_count_attribute.attr,
     NULL,
 };
 
+/* only the channels IO has, ch0 and up lead attrs[] */
+static umode_t channel_visible(struct kobject *kobj, struct attribute *attr, int n)
+{
+    if (n < RCIO_RCIN_MAX_CHANNELS && n >= rcio_from_object(kobj)->config.rc_input_count)
+        return 0;
+
+    return attr->mode;
+}
+
 static struct attribute_group attr_group = {
     .name = "rcin",
     .attrs = attrs,
+    .is_visible = channel_visible,
 };
 
-unsigned long timeout;
+static void store_frame(struct rcio_rcin *rcin)
+{
+    struct rcio_rc_frame *frame;
+    unsigned long flags;
+
+    spin_lock_irqsave(&rcin->ring_lock, flags);
 
-bool rcio_rcin_update(struct rcio_state *state)
+    frame = &rcin->ring[rcin->ring_head % RCIO_RC_RING_FRAMES];
+
+    *frame = (struct rcio_rc_frame) {
+        .timestamp_ns = ktime_get_ns(),
+        .frame_count = rcin->regs[PX4IO_P_RAW_FRAME_COUNT],
+        .lost_frame_count = rcin->regs[PX4IO_P_RAW_LOST_FRAME_COUNT],
+        .channel_count = rcin->regs[PX4IO_P_RAW_RC_COUNT],
+        .flags = rcin->regs[PX4IO_P_RAW_RC_FLAGS],
+        .rssi = rcin->regs[PX4IO_P_RAW_RC_NRSSI],
+    };
+
+    memcpy(frame->values, &rcin->regs[PX4IO_P_RAW_RC_BASE], rcin->rcio->config.rc_input_count * sizeof(uint16_t));
+
+    WRITE_ONCE(rcin->ring_head, rcin->ring_head + 1);
+
+    spin_unlock_irqrestore(&rcin->ring_lock, flags);
+}
+
+u32 rcio_rcin_frame_head(struct rcio_state *state)
 {
-    int ret;
-    struct rc_input_values report;
+    return READ_ONCE(state->rcin->ring_head);
+}
 
-    if (time_before(jiffies, timeout)) {
-        return false;
+bool rcio_rcin_frames_pending(struct rcio_state *state, u32 cursor)
+{
+    return READ_ONCE(state->rcin->ring_head) != cursor;
+}
+
+/* copies frames from *cursor on and advances it, a cursor overrun skips to the oldest frame kept */
+size_t rcio_rcin_read_frames(struct rcio_state *state, u32 *cursor, struct rcio_rc_frame *frames, size_t count)
+{
+    struct rcio_rcin *rcin = state->rcin;
+    unsigned long flags;
+    size_t copied = 0;
+
+    spin_lock_irqsave(&rcin->ring_lock, flags);
+
+    if (rcin->ring_head - *cursor > RCIO_RC_RING_FRAMES)
+        *cursor = rcin->ring_head - RCIO_RC_RING_FRAMES;
+
+    while (copied < count && *cursor != rcin->ring_head) {
+        frames[copied++] = rcin->ring[*cursor % RCIO_RC_RING_FRAMES];
+        (*cursor)++;
     }
 
-    ret = rcin_get_raw_values(state, &report);
+    spin_unlock_irqrestore(&rcin->ring_lock, flags);
 
-    if (ret == -ENOTCONN) {
-        connected = false;
-        return true;
-    } else if (ret < 0) {
-        connected = false;
-        return false;
+    return copied;
+}
+
+static void publish_telemetry(struct rcio_rcin *rcin)
+{
+    struct rcio_telemetry_rc *rc = &rcin->rcio->telemetry->rc;
+
+    rcio_telemetry_begin(&rc->sequence);
+    rc->timestamp_ns = ktime_get_ns();
+
+    if (rcin->connected) {
+        rc->channel_count = rcin->rcio->config.rc_input_count;
+        rc->source = rcin->report.input_source;
+        rc->frame_count = rcin->frame_count;
+        rc->lost_frame_count = rcin->lost_frame_count;
+        memcpy(rc->values, rcin->measurements, sizeof(rcin->measurements));
     }
 
-    connected = true;
+    rc->connected = rcin->connected;
+    rcio_telemetry_end(&rc->sequence);
+}
+
+static void rcin_read_complete(struct rcio_transaction *t)
+{
+    struct rcio_rcin *rcin = t->context;
+    struct rcio_state *rcio = rcin->rcio;
+    bool was_connected = rcin->connected;
+    bool fresh = false;
+    /* the source bits only live in the status page, use what the status module read last */
+    int ret = rcin_get_raw_values(rcin, rcin->regs[PX4IO_P_RAW_RC_FLAGS],
+            READ_ONCE(rcio->telemetry->status.flags), &rcin->report);
+
+    if (ret < 0) {
+        rcin->connected = false;
+    } else {
+        rcin->connected = true;
+
+        /* the poll period is shorter than most RC frames, skip repeats */
+        fresh = !was_connected || rcin->regs[PX4IO_P_RAW_FRAME_COUNT] != rcin->frame_count;
+
+        rcin->frame_count = rcin->regs[PX4IO_P_RAW_FRAME_COUNT];
+        rcin->lost_frame_count = rcin->regs[PX4IO_P_RAW_LOST_FRAME_COUNT];
+        memcpy(rcin->report.values, &rcin->regs[PX4IO_P_RAW_RC_BASE], rcio->config.rc_input_count * sizeof(uint16_t));
 
-    for (int i = 0; i < RCIO_RCIN_MAX_CHANNELS; i++) {
-        if (report.values[i] > 2500 || report.values[i] < 800) {
-           continue; 
+        if (fresh) {
+            store_frame(rcin);
         }
 
-        measurements[i] = report.values[i];
+        for (int i = 0; i < rcio->config.rc_input_count; i++) {
+            if (rcin->report.values[i] > 2500 || rcin->report.values[i] < 800) {
+               continue; 
+            }
+
+            rcin->measurements[i] = rcin->report.values[i];
+        }
+    }
+
+    if (fresh || rcin->connected != was_connected) {
+        publish_telemetry(rcin);
+        rcio_telemetry_notify(rcio);
+
+        if (rcin->frame_count_node)
+            sysfs_notify_dirent(rcin->frame_count_node);
+    }
+
+    WRITE_ONCE(rcin->busy, false);
+}
+
+bool rcio_rcin_update(struct rcio_state *state)
+{
+    struct rcio_rcin *rcin = state->rcin;
+    ktime_t deadline;
+
+    /* previous read still queued */
+    if (READ_ONCE(rcin->busy)) {
+        return false;
+    }
+
+    deadline = ktime_add_us(ktime_get(), rcin->subsystem.period_us);
+
+    /* count, flags, RSSI, frame counters and channels in one burst, the values are ignored without RC_OK */
+    rcin->read = (struct rcio_transaction) {
+        .page = PX4IO_PAGE_RAW_RC_INPUT, .offset = PX4IO_P_RAW_RC_COUNT,
+        .count = PX4IO_P_RAW_RC_BASE + state->config.rc_input_count, .write = false, .values = rcin->regs,
+        .class = RCIO_CLASS_RC_INPUT, .deadline = deadline,
+        .complete = rcin_read_complete,
+        .context = rcin,
+    };
+
+    rcin->busy = true;
+
+    if (state->register_submit(state, &rcin->read, 1) < 0) {
+        rcin->busy = false;
+        rcin->connected = false;
+        return false;
     }
-    
-    timeout = jiffies + HZ / 100; /* timeout in 100 mS */
 
     return true;
 }
 
+static const struct rcio_subsystem rcin_subsystem = {
+    .name = "rcin",
+    .priority = 1,
+    .period_us = 10000, /* 100 Hz */
+    .update = rcio_rcin_update,
+};
+
 int rcio_rcin_probe(struct rcio_state *state)
 {
+    struct rcio_rcin *rcin;
     int ret;
 
-    rcio = state;
+    rcin = kzalloc(sizeof(struct rcio_rcin), GFP_KERNEL);
+
+    if (rcin == NULL)
+        return -ENOMEM;
 
-    timeout = jiffies + HZ / 100; /* timeout in 100 ms */
+    /* freed along with the state, open files may still read the ring */
+    state->rcin = rcin;
+    rcin->rcio = state;
+    rcin->subsystem = rcin_subsystem;
+    spin_lock_init(&rcin->ring_lock);
 
-    ret = sysfs_create_group(rcio->object, &attr_group);
+    ret = sysfs_create_group(&state->object, &attr_group);
 
     if (ret < 0) {
         printk(KERN_INFO "sysfs failed\n");
+    } else {
+        struct kernfs_node *group = sysfs_get_dirent(state->object.sd, "rcin");
+
+        if (group) {
+            rcin->frame_count_node = sysfs_get_dirent(group, "frame_count");
+            sysfs_put(group);
+        }
     }
 
-    connected = false;
+    rcin->connected = false;
 
-    return 0;
+    return state->register_subsystem(state, &rcin->subsystem);
 }
 
-static int rcin_get_raw_values(struct rcio_state *state, struct rc_input_values *rc_val)
+/* once nothing completes any more, the ring itself stays for open files */
+void rcio_rcin_remove(struct rcio_state *state)
 {
-    uint16_t status;
-    int ret;
+    struct rcio_rcin *rcin = state->rcin;
+
+    if (rcin == NULL)
+        return;
+
+    if (rcin->frame_count_node) {
+        sysfs_put(rcin->frame_count_node);
+        rcin->frame_count_node = NULL;
+    }
+}
 
-    if ((ret = state->register_get(state, PX4IO_PAGE_STATUS, PX4IO_P_STATUS_FLAGS, &status, 1)) < 0) {
-        return ret;
+static int rcin_get_raw_values(struct rcio_rcin *rcin, uint16_t rc_flags, uint16_t status, struct rc_input_values *rc_val)
+{
+    /* raw R/C input values */
+    if (rcin->read.result < 0) {
+        return -EIO;
     }
 
-    /* if no R/C input, don't try to fetch anything */
-    if (!(status & PX4IO_P_STATUS_FLAGS_RC_OK)) {
+    /* if no R/C input, don't try to use anything */
+    if (!(rc_flags & PX4IO_P_RAW_RC_FLAGS_RC_OK)) {
         return -ENOTCONN;
     }
 
@@ -161,17 +379,15 @@ static int rcin_get_raw_values(struct rcio_state *state, struct rc_input_values
         rc_val->input_source = RC_INPUT_SOURCE_UNKNOWN;
     }
 
-    /* read raw R/C input values */
-    if (state->register_get(state, PX4IO_PAGE_RAW_RC_INPUT, PX4IO_P_RAW_RC_BASE, 
-                &(rc_val->values[0]), RCIO_RCIN_MAX_CHANNELS) < 0) {
-        return -EIO;
-    }
-    
     return 0;
 }
 
 EXPORT_SYMBOL_GPL(rcio_rcin_probe);
 EXPORT_SYMBOL_GPL(rcio_rcin_update);
+EXPORT_SYMBOL_GPL(rcio_rcin_remove);
+EXPORT_SYMBOL_GPL(rcio_rcin_frame_head);
+EXPORT_SYMBOL_GPL(rcio_rcin_frames_pending);
+EXPORT_SYMBOL_GPL(rcio_rcin_read_frames);
 
 MODULE_AUTHOR("Georgii Staroselskii <georgii.staroselskii@emlid.com>");
 MODULE_DESCRIPTION("RCIO RC Input driver");
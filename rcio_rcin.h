@@ -5,5 +5,10 @@
 
 int rcio_rcin_probe(struct rcio_state* state);
 bool rcio_rcin_update(struct rcio_state* state);
+void rcio_rcin_remove(struct rcio_state *state);
+
+u32 rcio_rcin_frame_head(struct rcio_state *state);
+bool rcio_rcin_frames_pending(struct rcio_state *state, u32 cursor);
+size_t rcio_rcin_read_frames(struct rcio_state *state, u32 *cursor, struct rcio_rc_frame *frames, size_t count);
 
 #endif
@@ -1,133 +1,212 @@
 #include <linux/delay.h>
 #include <linux/module.h>
+#include <linux/slab.h>
 #include <linux/spi/spi.h>
 
 #include "rcio.h"
 #include "protocol.h"
+#include "rcio_packet.h"
+#include "rcio_trace.h"
 
-static struct IOPacket *buffer;
+#define RCIO_SPI_TURNAROUND_US 150
 
-static int wait_complete(struct spi_device *spi)
-{
-    int ret;
+static bool pipeline = false;
+module_param(pipeline, bool, 0644);
+MODULE_PARM_DESC(pipeline, "Clock out the next request in the same transfer as the previous reply");
 
-    buffer->crc = 0;
-    buffer->crc = crc_packet(buffer);
+static bool short_frames = true;
+module_param(short_frames, bool, 0444);
+MODULE_PARM_DESC(short_frames, "Try frames sized by the register count, fall back to full frames if IO needs them");
 
-    usleep_range(120, 150);
+/* one per board, found from the adapter or the spi_device */
+struct rcio_spi {
+    struct rcio_adapter adapter;
+    struct spi_device *spi;
 
-    ret = spi_write_then_read(spi, (char *) buffer, sizeof(struct IOPacket), NULL, 0);
-    
-    if (ret < 0)
-        return ret;
+    /* set at probe time once IO is known to handle frames shorter than struct IOPacket */
+    bool variable_frames;
 
-    usleep_range(120, 150);
-    ret = spi_write_then_read(spi, NULL, 0, (char *) buffer, sizeof(struct IOPacket));
+    /* one slot per transaction of a batch */
+    struct IOPacket *tx_buffers;
+    struct IOPacket *rx_buffers;
 
-    if (ret < 0)
-        return ret;
+    /* a plain transaction takes two transfers, a pipelined batch one more than its size */
+    struct spi_transfer transfers[2 * RCIO_BATCH_MAX];
+    struct spi_message message;
 
-    return 0;
+    struct rcio_transaction **batch;
+    size_t batch_count;
+    bool batch_pipelined;
+};
+
+/* the CRC covers count registers, so a read request still carries them */
+static size_t request_size(struct rcio_spi *bus, const struct rcio_transaction *t)
+{
+    if (!bus->variable_frames)
+        return sizeof(struct IOPacket);
+
+    return offsetof(struct IOPacket, regs) + 2 * t->count;
 }
 
-static int rcio_spi_write(struct rcio_adapter *state, u16 address, const char *data, size_t count)
+/* IO answers a write with a bare header */
+static size_t reply_size(struct rcio_spi *bus, const struct rcio_transaction *t)
 {
-    int result;
-    struct spi_device *spi = state->client;
-    u16 *values = (u16 *) data;
-    u8 page = address >> 8;
-    u8 offset = address & 0xff;
+    if (!bus->variable_frames)
+        return sizeof(struct IOPacket);
 
-    if (count > PKT_MAX_REGS)
-        return -EINVAL;
+    return offsetof(struct IOPacket, regs) + (t->write ? 0 : 2 * t->count);
+}
+
+/*
+ * Plain mode sends each request and clocks in its reply in the next
+ * transfer. In pipelined mode transfer i clocks out request i and clocks in
+ * the reply to request i - 1, so n transactions take n + 1 transfers instead
+ * of 2n. The trailing transfer sends zeros just like a plain reply phase.
+ */
+static void build_message(struct rcio_spi *bus, struct rcio_transaction **t, size_t count)
+{
+    struct spi_transfer *transfers = bus->transfers;
+    size_t n = 0;
+
+    bus->batch_pipelined = pipeline;
+
+    spi_message_init(&bus->message);
+    memset(bus->transfers, 0, sizeof(bus->transfers));
+
+    for (size_t i = 0; i < count; i++) {
+        struct spi_transfer *xfer = &transfers[n++];
+
+        trace_rcio_transaction_start(&bus->spi->dev, t[i]);
+
+        rcio_packet_pack(&bus->tx_buffers[i], t[i], !bus->variable_frames);
+        xfer->tx_buf = &bus->tx_buffers[i];
+        xfer->len = request_size(bus, t[i]);
+
+        if (bus->batch_pipelined) {
+            if (i > 0) {
+                xfer->rx_buf = &bus->rx_buffers[i - 1];
+                xfer->len = max_t(size_t, xfer->len, reply_size(bus, t[i - 1]));
+            }
+        } else {
+            xfer = &transfers[n++];
+            xfer->rx_buf = &bus->rx_buffers[i];
+            xfer->len = reply_size(bus, t[i]);
+        }
+    }
+
+    if (bus->batch_pipelined) {
+        struct spi_transfer *xfer = &transfers[n++];
+
+        xfer->rx_buf = &bus->rx_buffers[count - 1];
+        xfer->len = reply_size(bus, t[count - 1]);
+    }
 
-    buffer->count_code = count | PKT_CODE_WRITE;
-    buffer->page = page;
-    buffer->offset = offset;
+    /* IO needs some time between a request and its reply, and before the next request */
+    for (size_t i = 0; i < n; i++) {
+        transfers[i].delay_usecs = RCIO_SPI_TURNAROUND_US;
+        transfers[i].cs_change = (i + 1 < n);
+        spi_message_add_tail(&transfers[i], &bus->message);
+    }
+}
 
-    memcpy(&buffer->regs[0], (void *)values, (2 * count));
-    for (unsigned i = count; i < PKT_MAX_REGS; i++)
-        buffer->regs[i] = 0x55aa;
+static void finish_message(struct rcio_spi *bus, struct rcio_transaction **t, size_t count, int status)
+{
+    for (size_t i = 0; i < count; i++) {
+        struct IOPacket *reply = &bus->rx_buffers[i];
+        enum rcio_packet_crc crc = RCIO_PACKET_CRC_UNCHECKED;
 
-    /* start the transaction and wait for it to complete */
-    result = wait_complete(spi);
+        if (status < 0) {
+            t[i]->result = status;
 
-    /* successful transaction? */
-    if (result == 0) {
-        uint8_t crc = buffer->crc;
-        buffer->crc = 0;
+        /* IO echoes page and offset, anything else is a reply to some other request */
+        } else if (bus->batch_pipelined && (reply->page != t[i]->page || reply->offset != t[i]->offset)) {
+            t[i]->result = -EIO;
 
-        if (crc != crc_packet(buffer)) {
-            result = -EIO;
-        } else if (PKT_CODE(*buffer) == PKT_CODE_ERROR) {
-            result = -EINVAL;
+        } else {
+            t[i]->result = rcio_packet_unpack(reply, t[i], &crc);
         }
 
+        trace_rcio_transaction_end(&bus->spi->dev, t[i], crc);
     }
+}
+
+static void rcio_spi_complete(void *context)
+{
+    struct rcio_spi *bus = context;
 
-    if (result == 0)
-        result = count;
+    finish_message(bus, bus->batch, bus->batch_count, bus->message.status);
 
-    return result;
+    rcio_complete(&bus->adapter);
 }
 
-static int rcio_spi_read(struct rcio_adapter *state, u16 address, char *data, size_t count)
+static int rcio_spi_submit(struct rcio_adapter *state, struct rcio_transaction **transactions, size_t count)
 {
-    int result;
-    struct spi_device *spi = state->client;
-    u16 *values = (u16 *) data;
-    u8 page = address >> 8;
-    u8 offset = address & 0xff;
+    struct rcio_spi *bus = container_of(state, struct rcio_spi, adapter);
 
-    if (count > PKT_MAX_REGS)
+    if (count == 0 || count > RCIO_BATCH_MAX)
         return -EINVAL;
 
-    buffer->count_code = count | PKT_CODE_READ;
-    buffer->page = page;
-    buffer->offset = offset;
+    bus->batch = transactions;
+    bus->batch_count = count;
 
-    /* start the transaction and wait for it to complete */
-    result = wait_complete(spi);
+    build_message(bus, transactions, count);
 
-    /* successful transaction? */
-    if (result == 0) {
-        uint8_t crc = buffer->crc;
-        buffer->crc = 0;
+    bus->message.complete = rcio_spi_complete;
+    bus->message.context = bus;
 
-        if (crc != crc_packet(buffer)) {
-            result = -EIO;
-
-        /* check result in packet */
-        } else if (PKT_CODE(*buffer) == PKT_CODE_ERROR) {
+    return spi_async(bus->spi, &bus->message);
+}
 
-            /* IO didn't like it - no point retrying */
-            result = -EINVAL;
+static int transfer_sync(struct rcio_spi *bus, struct rcio_transaction *t)
+{
+    int ret;
 
-        /* compare the received count with the expected count */
-        } else if (PKT_COUNT(*buffer) != count) {
+    build_message(bus, &t, 1);
 
-            /* IO returned the wrong number of registers - no point retrying */
-            result = -EIO;
+    ret = spi_sync(bus->spi, &bus->message);
 
-        /* successful read */
-        } else {
+    finish_message(bus, &t, 1, ret);
 
-            /* copy back the result */
-            memcpy(values, &buffer->regs[0], (2 * count));
-        }
+    return t->result;
+}
 
+/*
+ * Read the protocol version with a short frame. IO firmware that only
+ * handles full frames won't produce a valid single register reply.
+ */
+static void probe_frames(struct rcio_spi *bus)
+{
+    struct spi_device *spi = bus->spi;
+    u16 version;
+    struct rcio_transaction t = {
+        .page = PX4IO_PAGE_CONFIG,
+        .offset = PX4IO_P_CONFIG_PROTOCOL_VERSION,
+        .count = 1,
+        .write = false,
+        .values = &version,
+    };
+
+    if (!short_frames)
+        return;
+
+    bus->variable_frames = true;
+
+    if (transfer_sync(bus, &t) == 1) {
+        dev_info(&spi->dev, "using variable-length frames, protocol version %u\n", version);
+        return;
     }
 
-    if (result == 0)
-        result = count;
+    bus->variable_frames = false;
 
-    return result;
-}
+    /* let IO resynchronise on a full frame before anything else goes out */
+    transfer_sync(bus, &t);
 
-struct rcio_adapter st;
+    dev_info(&spi->dev, "IO needs full frames\n");
+}
 
 static int rcio_spi_probe(struct spi_device *spi)
 {
+	struct rcio_spi *bus;
 	int ret;
 
 	spi->mode = SPI_MODE_0;
@@ -137,37 +216,57 @@ static int rcio_spi_probe(struct spi_device *spi)
 	if (ret < 0)
 		return ret;
 
-	st.client = spi;
-    st.dev = &spi->dev;
-    st.write = rcio_spi_write;
-    st.read = rcio_spi_read;
+    bus = kzalloc(sizeof(struct rcio_spi), GFP_KERNEL);
+
+    if (bus == NULL)
+        return -ENOMEM;
+
+    bus->spi = spi;
+	bus->adapter.client = spi;
+    bus->adapter.dev = &spi->dev;
+    bus->adapter.submit = rcio_spi_submit;
 
-    buffer = kmalloc(sizeof(struct IOPacket), GFP_DMA | GFP_KERNEL);
+    /* separate kmalloc'ed buffers are DMA-safe, so spi_sync never bounces them */
+    bus->tx_buffers = kcalloc(RCIO_BATCH_MAX, sizeof(struct IOPacket), GFP_DMA | GFP_KERNEL);
+    bus->rx_buffers = kcalloc(RCIO_BATCH_MAX, sizeof(struct IOPacket), GFP_DMA | GFP_KERNEL);
 
-    if (buffer == NULL) {
+    if (bus->tx_buffers == NULL || bus->rx_buffers == NULL) {
         printk(KERN_INFO "No memory\n");
-        return -ENOMEM;
+        ret = -ENOMEM;
+        goto errout_free;
     }
+
+    probe_frames(bus);
     
-    ret = rcio_probe(&st);
+    ret = rcio_probe(&bus->adapter);
 	if (ret < 0) {
-        kfree(buffer);
-        return ret;
+        goto errout_free;
     }
 
+    spi_set_drvdata(spi, bus);
+
     return 0;
+
+errout_free:
+    kfree(bus->rx_buffers);
+    kfree(bus->tx_buffers);
+    kfree(bus);
+    return ret;
 }
 
 static int rcio_spi_remove(struct spi_device *spi)
 {
-    int ret = rcio_remove(&st);
+    struct rcio_spi *bus = spi_get_drvdata(spi);
+    int ret = rcio_remove(&bus->adapter);
 
     if (ret < 0) {
         dev_err(&spi->dev, "rcio_remove=%d", ret);
         return ret;
     }
 
-    kfree(buffer);
+    kfree(bus->rx_buffers);
+    kfree(bus->tx_buffers);
+    kfree(bus);
 
     return ret;
 }
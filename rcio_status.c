@@ -1,34 +1,63 @@
 #include <linux/delay.h>
 #include <linux/module.h>
+#include <linux/slab.h>
 
 #include "rcio.h"
 #include "protocol.h"
 
 #define RCIO_ADC_CHANNELS_COUNT 6
 
-static void handle_status(uint16_t status);
-static void handle_alarms(uint16_t alarms);
+struct rcio_status {
+    struct rcio_state *rcio;
 
-struct rcio_state *rcio;
+    /* completion path only, readers use the telemetry block */
+    bool init_ok;
+    bool pwm_ok;
+    bool alive;
+
+    struct rcio_subsystem subsystem;
+
+    uint16_t regs[6];
+    struct rcio_transaction read;
+    bool busy;
+};
+
+static void handle_status(struct rcio_status *io, uint16_t status);
+static void handle_alarms(struct rcio_status *io, uint16_t alarms);
 
 bool rcio_status_update(struct rcio_state *state);
 
-static bool init_ok;
-static bool pwm_ok;
-static bool alive;
+/* the flags of one status read, never half of an update */
+static void snapshot(struct kobject *kobj, struct rcio_telemetry_status *copy)
+{
+    rcio_telemetry_snapshot(&rcio_from_object(kobj)->telemetry->status, copy);
+}
+
 static ssize_t init_ok_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf)
 {
-    return sprintf(buf, "%d\n", init_ok? 1: 0);
+    struct rcio_telemetry_status copy;
+
+    snapshot(kobj, &copy);
+
+    return sprintf(buf, "%d\n", copy.init_ok? 1: 0);
 }
 
 static ssize_t pwm_ok_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf)
 {
-    return sprintf(buf, "%d\n", pwm_ok? 1: 0);
+    struct rcio_telemetry_status copy;
+
+    snapshot(kobj, &copy);
+
+    return sprintf(buf, "%d\n", copy.pwm_ok? 1: 0);
 }
 
 static ssize_t alive_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf)
 {
-    return sprintf(buf, "%d\n", alive? 1: 0);
+    struct rcio_telemetry_status copy;
+
+    snapshot(kobj, &copy);
+
+    return sprintf(buf, "%d\n", copy.alive? 1: 0);
 }
 
 static struct kobj_attribute init_ok_attribute = __ATTR(init_ok, S_IRUGO, init_ok_show, NULL);
@@ -47,65 +76,137 @@ static struct attribute_group attr_group = {
     .attrs = attrs,
 };
 
-unsigned long timeout;
+static void publish_telemetry(struct rcio_status *io)
+{
+    struct rcio_telemetry_status *status = &io->rcio->telemetry->status;
+
+    rcio_telemetry_begin(&status->sequence);
+    status->timestamp_ns = ktime_get_ns();
+    status->flags = io->regs[0];
+    status->alarms = io->regs[1];
+    status->init_ok = io->init_ok;
+    status->pwm_ok = io->pwm_ok;
+    status->alive = io->alive;
+    rcio_telemetry_end(&status->sequence);
+}
 
-bool rcio_status_update(struct rcio_state *state)
+static void status_read_complete(struct rcio_transaction *t)
 {
-    uint16_t regs[6];
+    struct rcio_status *io = t->context;
 
-    if (time_before(jiffies, timeout)) {
-        return false;
+    if (t->result < 0) {
+        io->alive = false;
+    } else {
+        /* IO may have restarted while it didn't answer, and dropping INIT_OK says it did */
+        if (!io->alive || (io->init_ok && !(io->regs[0] & PX4IO_P_STATUS_FLAGS_INIT_OK)))
+            io->rcio->cache_invalidate(io->rcio);
+
+        io->alive = true;
+
+        handle_status(io, io->regs[0]);
+        handle_alarms(io, io->regs[1]);
     }
 
-    if (state->register_get(state, PX4IO_PAGE_STATUS, PX4IO_P_STATUS_FLAGS, regs, ARRAY_SIZE(regs)) < 0) {
-        alive = false;
+    publish_telemetry(io);
+
+    WRITE_ONCE(io->busy, false);
+}
+
+bool rcio_status_update(struct rcio_state *state)
+{
+    struct rcio_status *io = state->status;
+
+    /* previous read still queued */
+    if (READ_ONCE(io->busy)) {
         return false;
     }
 
-    alive = true;
+    io->read = (struct rcio_transaction) {
+        .page = PX4IO_PAGE_STATUS, .offset = PX4IO_P_STATUS_FLAGS,
+        .count = ARRAY_SIZE(io->regs), .write = false, .values = io->regs,
+        .class = RCIO_CLASS_TELEMETRY,
+        .deadline = ktime_add_us(ktime_get(), io->subsystem.period_us),
+        .complete = status_read_complete,
+        .context = io,
+    };
 
-    handle_status(regs[0]);
-    handle_alarms(regs[1]);
+    io->busy = true;
+
+    if (state->register_submit(state, &io->read, 1) < 0) {
+        io->busy = false;
+        io->alive = false;
+        return false;
+    }
 
-    timeout = jiffies + HZ / 5; /* timeout in 0.5s */
     return true;
 }
 
+static const struct rcio_subsystem status_subsystem = {
+    .name = "status",
+    .priority = 3,
+    .period_us = 200000, /* 5 Hz */
+    .update = rcio_status_update,
+};
+
 
 bool rcio_status_probe(struct rcio_state *state)
 {
+    struct rcio_status *io;
     int ret;
 
-    rcio = state;
+    io = kzalloc(sizeof(struct rcio_status), GFP_KERNEL);
 
-    timeout = jiffies + HZ / 50; /* timeout in 0.05s */
+    if (io == NULL) {
+        pr_err("[RCIO]: status module not allocated\n");
+        return false;
+    }
 
-    ret = sysfs_create_group(rcio->object, &attr_group);
+    /* freed along with the state */
+    state->status = io;
+    io->rcio = state;
+    io->subsystem = status_subsystem;
+
+    ret = sysfs_create_group(&state->object, &attr_group);
 
     if (ret < 0) {
         pr_err(KERN_INFO "[RCIO]: status module not registered int sysfs\n");
     }
 
-    init_ok = false;
+    /* IO answering now means what the other probes just wrote is on it, only a later drop-out flushes the cache */
+    if (state->register_get(state, PX4IO_PAGE_STATUS, PX4IO_P_STATUS_FLAGS, io->regs, ARRAY_SIZE(io->regs)) < 0) {
+        io->init_ok = false;
+        io->alive = false;
+    } else {
+        io->alive = true;
+
+        handle_status(io, io->regs[0]);
+        handle_alarms(io, io->regs[1]);
+    }
+
+    publish_telemetry(io);
+
+    if (state->register_subsystem(state, &io->subsystem) < 0) {
+        pr_err("[RCIO]: status module not scheduled\n");
+    }
 
     return true;
 }
 
-static void handle_status(uint16_t status)
+static void handle_status(struct rcio_status *io, uint16_t status)
 {
     if (status & PX4IO_P_STATUS_FLAGS_INIT_OK) {
-        init_ok = true;
+        io->init_ok = true;
     } else {
-        init_ok = false;
+        io->init_ok = false;
     }
 }
 
-static void handle_alarms(uint16_t alarms)
+static void handle_alarms(struct rcio_status *io, uint16_t alarms)
 {
     if (alarms & PX4IO_P_STATUS_ALARMS_PWM_ERROR) {
-        pwm_ok = false;
+        io->pwm_ok = false;
     } else {
-        pwm_ok = true;
+        io->pwm_ok = true;
     }
 }
 
@@ -0,0 +1,497 @@
+#include <linux/delay.h>
+#include <linux/hrtimer.h>
+#include <linux/kernel.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
+#include <linux/module.h>
+#include <linux/random.h>
+#include <linux/sched.h>
+
+#include "rcio.h"
+#include "protocol.h"
+#include "rcio_loopback.h"
+#include "rcio_packet.h"
+
+/*
+ * Checks the packet code and the register API, then times the packet code.
+ * Everything runs once at load time, the register checks against a board of
+ * rcio_loopback:
+ *
+ *     modprobe rcio_loopback && modprobe rcio_test
+ *
+ * Results go to the kernel log and loading fails if any check does. Both
+ * modules are only built with CONFIG_RCIO_TEST=m, see the Makefile. Most
+ * checks stay off the pages the modules use, but the cache check reboots
+ * the loopback IO, which wipes every register including arming and
+ * safety. Only load it against a board nothing else depends on.
+ */
+
+static unsigned int board;
+module_param(board, uint, 0444);
+MODULE_PARM_DESC(board, "Loopback board to run the register checks on");
+
+static unsigned int bench_rounds = 10000;
+module_param(bench_rounds, uint, 0444);
+MODULE_PARM_DESC(bench_rounds, "Calls timed per benchmark, 0 skips the benchmarks");
+
+static unsigned int deadline_ms = 2000;
+module_param(deadline_ms, uint, 0444);
+MODULE_PARM_DESC(deadline_ms, "How long to run actuator frames against a flood of reads, 0 skips it");
+
+/* a page nothing but this module touches, and a cached one no module uses */
+#define RCIO_TEST_PAGE PX4IO_PAGE_TEST
+#define RCIO_TEST_CACHED_PAGE PX4IO_PAGE_CONTROL_MIN_PWM
+
+static const u8 test_counts[] = { 1, 8, 14, 32 };
+
+static unsigned int checks;
+static unsigned int failures;
+
+#define rcio_check(cond, fmt, ...) do { \
+    checks++; \
+    if (!(cond)) { \
+        failures++; \
+        pr_err("[RCIO]: test: " fmt "\n", ##__VA_ARGS__); \
+    } \
+} while (0)
+
+/* crc_packet() one byte at a time, as protocol.h had it before slice-by-4 */
+static u8 crc_reference(struct IOPacket *packet)
+{
+    const u8 *end = (const u8 *)&packet->regs[PKT_COUNT(*packet)];
+    const u8 *p = (const u8 *)packet;
+    u8 c = 0;
+
+    while (p < end)
+        c = crc8_tab[c ^ *(p++)];
+
+    return c;
+}
+
+/* every length, so each tail the four byte steps leave gets covered */
+static void test_crc(void)
+{
+    struct IOPacket packet;
+
+    for (unsigned count = 0; count <= PKT_MAX_REGS; count++) {
+        for (int round = 0; round < 16; round++) {
+            get_random_bytes(&packet, sizeof(packet));
+            packet.count_code = count | (packet.count_code & PKT_CODE_MASK);
+
+            rcio_check(crc_packet(&packet) == crc_reference(&packet),
+                    "CRC of %u registers differs from the byte-wise one", count);
+        }
+    }
+}
+
+/* written once per run so the compiler can't drop the timed work */
+static u8 bench_sink;
+
+/* a read reply carries the registers the same way a write request does */
+static void build_reply(struct IOPacket *packet, const struct rcio_transaction *t, u16 *values, u8 code,
+        bool full_frame)
+{
+    struct rcio_transaction request = *t;
+
+    request.write = true;
+    request.values = values;
+    rcio_packet_pack(packet, &request, full_frame);
+
+    packet->count_code = t->count | code;
+    rcio_packet_sign(packet);
+}
+
+static void test_packets(u8 count, bool full_frame)
+{
+    const char *frames = full_frame ? "full" : "variable";
+    u16 values[PKT_MAX_REGS];
+    u16 readback[PKT_MAX_REGS];
+    struct IOPacket packet;
+    struct rcio_transaction t = {
+        .page = PX4IO_PAGE_DIRECT_PWM, .offset = 0, .count = count, .write = true, .values = values,
+    };
+    enum rcio_packet_crc crc_result;
+    u8 crc;
+    int ret;
+
+    for (unsigned i = 0; i < count; i++)
+        values[i] = 1000 + 37 * i;
+
+    rcio_packet_pack(&packet, &t, full_frame);
+
+    rcio_check(PKT_COUNT(packet) == count && PKT_CODE(packet) == PKT_CODE_WRITE &&
+            !memcmp(packet.regs, values, 2 * count),
+            "%s frame of %u registers packed wrong", frames, count);
+
+    crc = packet.crc;
+    packet.crc = 0;
+    rcio_check(crc_packet(&packet) == crc, "%s frame of %u registers signed wrong", frames, count);
+
+    t.write = false;
+    t.values = readback;
+
+    build_reply(&packet, &t, values, PKT_CODE_SUCCESS, full_frame);
+    memset(readback, 0, sizeof(readback));
+    ret = rcio_packet_unpack(&packet, &t, &crc_result);
+    rcio_check(ret == count && crc_result == RCIO_PACKET_CRC_OK && !memcmp(readback, values, 2 * count),
+            "reply of %u registers unpacked to %d", count, ret);
+
+    build_reply(&packet, &t, values, PKT_CODE_SUCCESS, full_frame);
+    packet.regs[count - 1] ^= 0x0100;
+    ret = rcio_packet_unpack(&packet, &t, &crc_result);
+    rcio_check(ret == -EBADMSG && crc_result == RCIO_PACKET_CRC_BAD,
+            "corrupt reply of %u registers unpacked to %d", count, ret);
+
+    /* rejected before the CRC runs, so not reported as a CRC failure */
+    build_reply(&packet, &t, values, PKT_CODE_SUCCESS, full_frame);
+    packet.count_code = 0x3f | PKT_CODE_SUCCESS;
+    crc_result = RCIO_PACKET_CRC_UNCHECKED;
+    ret = rcio_packet_unpack(&packet, &t, &crc_result);
+    rcio_check(ret == -EBADMSG && crc_result == RCIO_PACKET_CRC_UNCHECKED,
+            "reply with a garbled count unpacked to %d", ret);
+
+    build_reply(&packet, &t, values, PKT_CODE_ERROR, full_frame);
+    ret = rcio_packet_unpack(&packet, &t, NULL);
+    rcio_check(ret == -EINVAL, "error reply of %u registers unpacked to %d", count, ret);
+
+    build_reply(&packet, &t, values, PKT_CODE_SUCCESS, full_frame);
+    packet.count_code = (count - 1) | PKT_CODE_SUCCESS;
+    rcio_packet_sign(&packet);
+    ret = rcio_packet_unpack(&packet, &t, NULL);
+    rcio_check(ret == -EIO, "reply with %u of %u registers unpacked to %d", count - 1, count, ret);
+}
+
+static void bench_packets(u8 count, bool full_frame)
+{
+    u16 values[PKT_MAX_REGS] = { 0 };
+    struct IOPacket packet;
+    struct rcio_transaction t = {
+        .page = PX4IO_PAGE_DIRECT_PWM, .offset = 0, .count = count, .write = true, .values = values,
+    };
+    u64 reference_ns, crc_ns, pack_ns, unpack_ns;
+    u8 sink = 0;
+    u8 crc;
+    u64 start;
+
+    rcio_packet_pack(&packet, &t, full_frame);
+
+    preempt_disable();
+    start = ktime_get_ns();
+    for (unsigned i = 0; i < bench_rounds; i++) {
+        sink ^= crc_reference(&packet);
+        barrier();
+    }
+    reference_ns = ktime_get_ns() - start;
+
+    start = ktime_get_ns();
+    for (unsigned i = 0; i < bench_rounds; i++) {
+        sink ^= crc_packet(&packet);
+        barrier();
+    }
+    crc_ns = ktime_get_ns() - start;
+
+    start = ktime_get_ns();
+    for (unsigned i = 0; i < bench_rounds; i++) {
+        rcio_packet_pack(&packet, &t, full_frame);
+        barrier();
+    }
+    pack_ns = ktime_get_ns() - start;
+    preempt_enable();
+
+    t.write = false;
+    build_reply(&packet, &t, values, PKT_CODE_SUCCESS, full_frame);
+    crc = packet.crc;
+
+    preempt_disable();
+    start = ktime_get_ns();
+    for (unsigned i = 0; i < bench_rounds; i++) {
+        /* unpacking zeroes the crc field it checks */
+        packet.crc = crc;
+        sink ^= rcio_packet_unpack(&packet, &t, NULL);
+        barrier();
+    }
+    unpack_ns = ktime_get_ns() - start;
+    preempt_enable();
+
+    WRITE_ONCE(bench_sink, sink);
+
+    pr_info("[RCIO]: test: %-8s %9u  %8llu  %6llu  %6llu  %6llu\n", full_frame ? "full" : "variable", count,
+            div_u64(reference_ns, bench_rounds), div_u64(crc_ns, bench_rounds),
+            div_u64(pack_ns, bench_rounds), div_u64(unpack_ns, bench_rounds));
+}
+
+/* the register API on a page the core only passes through, and on a cached one */
+static void test_registers(struct rcio_state *state)
+{
+    u16 values[8];
+    u16 readback[8];
+    int ret;
+
+    for (unsigned i = 0; i < ARRAY_SIZE(values); i++)
+        values[i] = 0x1234 + i;
+
+    ret = state->register_set(state, RCIO_TEST_PAGE, 0, values, ARRAY_SIZE(values));
+    rcio_check(ret == ARRAY_SIZE(values), "register_set returned %d", ret);
+    rcio_check(rcio_loopback_register(state, RCIO_TEST_PAGE, 7) == values[7], "register_set didn't reach IO");
+
+    memset(readback, 0, sizeof(readback));
+    ret = state->register_get(state, RCIO_TEST_PAGE, 0, readback, ARRAY_SIZE(readback));
+    rcio_check(ret == ARRAY_SIZE(readback) && !memcmp(readback, values, sizeof(values)),
+            "register_get returned %d", ret);
+
+    for (int cached = 0; cached < 2; cached++) {
+        u8 page = cached ? RCIO_TEST_CACHED_PAGE : RCIO_TEST_PAGE;
+
+        ret = state->register_set_byte(state, page, 10, 0x00f0);
+        rcio_check(ret == 1, "register_set_byte on page %u returned %d", page, ret);
+
+        ret = state->register_modify(state, page, 10, 0x0030, 0x0101);
+        rcio_check(ret == 1, "register_modify on page %u returned %d", page, ret);
+        rcio_check(rcio_loopback_register(state, page, 10) == 0x01c1,
+                "register_modify on page %u left IO at 0x%04x", page, rcio_loopback_register(state, page, 10));
+        rcio_check(state->register_get_byte(state, page, 10) == 0x01c1,
+                "register_modify on page %u read back wrong", page);
+
+        /* neither clearing nor setting anything is a plain rewrite */
+        ret = state->register_modify(state, page, 10, 0, 0);
+        rcio_check(ret == 1 && rcio_loopback_register(state, page, 10) == 0x01c1,
+                "empty register_modify on page %u returned %d", page, ret);
+    }
+}
+
+/* every failure reaches the caller as the adapter reported it */
+static void test_errors(struct rcio_state *state)
+{
+    static const int injected[] = { -EBADMSG, -EINVAL, -EIO, -ETIMEDOUT };
+    u16 values[PKT_MAX_REGS + 1] = { 0 };
+    u16 value;
+    int ret;
+
+    ret = state->register_get(state, RCIO_TEST_PAGE, 0, values, state->config.max_regs + 1);
+    rcio_check(ret == -EINVAL, "read past max_regs returned %d", ret);
+
+    ret = state->register_set_byte(state, PX4IO_PAGE_CONFIG, PX4IO_P_CONFIG_PROTOCOL_VERSION, 0);
+    rcio_check(ret == -EINVAL, "write IO rejects returned %d", ret);
+
+    ret = state->register_get(state, RCIO_TEST_PAGE, 120, values, 16);
+    rcio_check(ret == -EINVAL, "read past the end of the page returned %d", ret);
+
+    for (size_t i = 0; i < ARRAY_SIZE(injected); i++) {
+        rcio_loopback_fail(state, RCIO_TEST_PAGE, injected[i], 1);
+        ret = state->register_get(state, RCIO_TEST_PAGE, 0, values, 4);
+        rcio_check(ret == injected[i], "read failing with %d returned %d", injected[i], ret);
+    }
+
+    /* a failed read must not turn into a write */
+    state->register_set_byte(state, RCIO_TEST_PAGE, 20, 0x0f0f);
+    rcio_loopback_fail(state, RCIO_TEST_PAGE, -EBADMSG, 1);
+    ret = state->register_modify(state, RCIO_TEST_PAGE, 20, 0x000f, 0);
+    rcio_check(ret == -EBADMSG, "register_modify with a failing read returned %d", ret);
+    rcio_check(rcio_loopback_register(state, RCIO_TEST_PAGE, 20) == 0x0f0f, "register_modify wrote after a failed read");
+
+    /* a failed write leaves the cache unsure of the register, so the next read goes to IO */
+    state->register_set_byte(state, RCIO_TEST_CACHED_PAGE, 11, 1100);
+    rcio_loopback_fail(state, RCIO_TEST_CACHED_PAGE, -EIO, 1);
+    ret = state->register_set_byte(state, RCIO_TEST_CACHED_PAGE, 11, 1200);
+    rcio_check(ret == -EIO, "write failing with -EIO returned %d", ret);
+
+    ret = state->register_get(state, RCIO_TEST_CACHED_PAGE, 11, &value, 1);
+    rcio_check(ret == 1 && value == 1100, "read after a failed write returned %d, 0x%04x", ret, value);
+
+    /* and the write that failed goes through when retried */
+    ret = state->register_set_byte(state, RCIO_TEST_CACHED_PAGE, 11, 1200);
+    rcio_check(ret == 1 && rcio_loopback_register(state, RCIO_TEST_CACHED_PAGE, 11) == 1200,
+            "retried write returned %d", ret);
+}
+
+/* the shadow cache never answers for a write it hasn't seen complete */
+static void test_cache(struct rcio_state *state)
+{
+    u16 first = 1500;
+    u16 second = 1600;
+    u16 value = 0;
+    u16 reboot = PX4IO_REBOOT_BL_MAGIC;
+    struct rcio_transaction batch[2];
+    int ret;
+
+    state->register_set_byte(state, RCIO_TEST_CACHED_PAGE, 12, first);
+
+    /* a write reverting one in the same batch must still go out */
+    batch[0] = (struct rcio_transaction) {
+        .page = RCIO_TEST_CACHED_PAGE, .offset = 12, .count = 1, .write = true, .values = &second,
+    };
+    batch[1] = (struct rcio_transaction) {
+        .page = RCIO_TEST_CACHED_PAGE, .offset = 12, .count = 1, .write = true, .values = &first,
+    };
+    ret = state->register_transfer(state, batch, ARRAY_SIZE(batch));
+    rcio_check(ret == 0 && rcio_loopback_register(state, RCIO_TEST_CACHED_PAGE, 12) == first,
+            "reverting write returned %d, left IO at %d", ret, rcio_loopback_register(state, RCIO_TEST_CACHED_PAGE, 12));
+
+    /* a read behind a write in the same batch sees the write */
+    batch[0].values = &second;
+    batch[1] = (struct rcio_transaction) {
+        .page = RCIO_TEST_CACHED_PAGE, .offset = 12, .count = 1, .write = false, .values = &value,
+    };
+    ret = state->register_transfer(state, batch, ARRAY_SIZE(batch));
+    rcio_check(ret == 0 && value == second, "read behind a write returned %d, %u", ret, value);
+
+    /* nothing cached survives IO rebooting */
+    ret = state->register_set_byte(state, PX4IO_PAGE_SETUP, PX4IO_P_SETUP_REBOOT_BL, reboot);
+    rcio_check(ret == 1, "reboot returned %d", ret);
+
+    ret = state->register_get(state, RCIO_TEST_CACHED_PAGE, 12, &value, 1);
+    rcio_check(ret == 1 && value == 0, "read after a reboot returned %d, %u", ret, value);
+
+    ret = state->register_set_byte(state, RCIO_TEST_CACHED_PAGE, 12, second);
+    rcio_check(ret == 1 && rcio_loopback_register(state, RCIO_TEST_CACHED_PAGE, 12) == second,
+            "write after a reboot returned %d", ret);
+}
+
+#define RCIO_TEST_FRAME_PERIOD_NS (1000 * NSEC_PER_USEC)
+
+/* one transaction of the deadline check and the buffer it moves */
+struct rcio_test_slot {
+    struct rcio_transaction t;
+    u16 values[PKT_MAX_REGS];
+    bool busy;
+};
+
+static void slot_complete(struct rcio_transaction *t)
+{
+    struct rcio_test_slot *slot = t->context;
+
+    smp_store_release(&slot->busy, false);
+}
+
+static void slot_submit(struct rcio_state *state, struct rcio_test_slot *slot, ktime_t deadline)
+{
+    slot->t.deadline = deadline;
+    slot->t.complete = slot_complete;
+    slot->t.context = slot;
+    slot->busy = true;
+
+    if (state->register_submit(state, &slot->t, 1) < 0)
+        slot->busy = false;
+}
+
+/*
+ * Sends an actuator frame every millisecond the way rcio_pwm does, while
+ * keeping a full batch of long reads queued behind it. Reads deferred for
+ * a frame must never go out in front of it, so no frame may miss.
+ */
+static void test_deadlines(struct rcio_state *state)
+{
+    static struct rcio_test_slot frame;
+    static struct rcio_test_slot reads[RCIO_BATCH_MAX];
+    unsigned long misses = READ_ONCE(state->deadline_misses[RCIO_CLASS_ACTUATOR]);
+    unsigned long frames = 0;
+    unsigned long completed = 0;
+    ktime_t next = ktime_get();
+    ktime_t stop = ktime_add_ms(next, deadline_ms);
+    bool pending;
+
+    frame.t = (struct rcio_transaction) {
+        .page = RCIO_TEST_PAGE, .offset = 64, .count = 8, .write = true, .values = frame.values,
+        .class = RCIO_CLASS_ACTUATOR,
+    };
+
+    for (size_t i = 0; i < ARRAY_SIZE(reads); i++) {
+        reads[i].t = (struct rcio_transaction) {
+            .page = RCIO_TEST_PAGE, .offset = 0, .count = state->config.max_regs, .write = false,
+            .values = reads[i].values, .class = RCIO_CLASS_TELEMETRY,
+        };
+    }
+
+    while (ktime_before(next, stop)) {
+        /* a frame still out now is past its deadline and counted by the core */
+        if (!smp_load_acquire(&frame.busy)) {
+            frame.values[0] = frames++;
+            slot_submit(state, &frame, ktime_add_ns(next, RCIO_TEST_FRAME_PERIOD_NS));
+        }
+
+        for (size_t i = 0; i < ARRAY_SIZE(reads); i++) {
+            if (!smp_load_acquire(&reads[i].busy)) {
+                completed++;
+                slot_submit(state, &reads[i], ktime_set(0, 0));
+            }
+        }
+
+        next = ktime_add_ns(next, RCIO_TEST_FRAME_PERIOD_NS);
+
+        set_current_state(TASK_UNINTERRUPTIBLE);
+        schedule_hrtimeout_range(&next, 0, HRTIMER_MODE_ABS);
+    }
+
+    do {
+        msleep(10);
+
+        pending = smp_load_acquire(&frame.busy);
+        for (size_t i = 0; i < ARRAY_SIZE(reads); i++)
+            pending |= smp_load_acquire(&reads[i].busy);
+    } while (pending);
+
+    /* the first round of the loop found every read idle */
+    completed -= ARRAY_SIZE(reads);
+    misses = READ_ONCE(state->deadline_misses[RCIO_CLASS_ACTUATOR]) - misses;
+
+    pr_info("[RCIO]: test: %lu actuator frames, %lu missed, %lu reads in between\n", frames, misses, completed);
+
+    rcio_check(misses == 0, "%lu of %lu actuator frames missed their deadline", misses, frames);
+    rcio_check(completed > 0, "no read got past the actuator frames");
+}
+
+static int __init rcio_test_init(void)
+{
+    struct rcio_state *state;
+
+    test_crc();
+
+    for (size_t i = 0; i < ARRAY_SIZE(test_counts); i++) {
+        test_packets(test_counts[i], false);
+        test_packets(test_counts[i], true);
+    }
+
+    state = rcio_loopback_state(board);
+
+    if (state == NULL) {
+        pr_err("[RCIO]: test: no loopback board %u\n", board);
+        return -ENODEV;
+    }
+
+    test_registers(state);
+    test_errors(state);
+    /* reboots the loopback board, so after every check that needs its registers */
+    test_cache(state);
+
+    if (deadline_ms)
+        test_deadlines(state);
+
+    if (bench_rounds) {
+        pr_info("[RCIO]: test: %d rounds, ns per call\n", bench_rounds);
+        pr_info("[RCIO]: test: frames   registers  bytewise     crc    pack  unpack\n");
+
+        for (size_t i = 0; i < ARRAY_SIZE(test_counts); i++) {
+            bench_packets(test_counts[i], false);
+            bench_packets(test_counts[i], true);
+        }
+    }
+
+    if (failures) {
+        pr_err("[RCIO]: test: %u of %u checks failed\n", failures, checks);
+        return -EINVAL;
+    }
+
+    pr_info("[RCIO]: test: all %u checks passed\n", checks);
+
+    return 0;
+}
+
+static void __exit rcio_test_exit(void)
+{
+}
+
+module_init(rcio_test_init);
+module_exit(rcio_test_exit);
+
+MODULE_DESCRIPTION("RCIO protocol and register API checks");
+MODULE_LICENSE("GPL v2");
@@ -0,0 +1,151 @@
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM rcio
+
+#if !defined(_RCIO_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _RCIO_TRACE_H
+
+#include <linux/device.h>
+#include <linux/tracepoint.h>
+
+#include "rcio.h"
+#include "rcio_packet.h"
+
+/* created in rcio_core.c, the adapters fire the transaction events */
+
+TRACE_EVENT(rcio_transaction_start,
+
+    TP_PROTO(struct device *dev, const struct rcio_transaction *t),
+
+    TP_ARGS(dev, t),
+
+    TP_STRUCT__entry(
+        __string(dev, dev_name(dev))
+        __field(u8, page)
+        __field(u8, offset)
+        __field(u8, count)
+        __field(bool, write)
+        __field(int, class)
+    ),
+
+    TP_fast_assign(
+        __assign_str(dev, dev_name(dev));
+        __entry->page = t->page;
+        __entry->offset = t->offset;
+        __entry->count = t->count;
+        __entry->write = t->write;
+        __entry->class = t->class;
+    ),
+
+    TP_printk("%s %s page=%u offset=%u count=%u class=%d",
+        __get_str(dev), __entry->write ? "write" : "read",
+        __entry->page, __entry->offset, __entry->count, __entry->class)
+);
+
+TRACE_EVENT(rcio_transaction_end,
+
+    TP_PROTO(struct device *dev, const struct rcio_transaction *t, enum rcio_packet_crc crc),
+
+    TP_ARGS(dev, t, crc),
+
+    TP_STRUCT__entry(
+        __string(dev, dev_name(dev))
+        __field(u8, page)
+        __field(u8, offset)
+        __field(u8, count)
+        __field(bool, write)
+        __field(int, result)
+        __field(u8, crc)
+    ),
+
+    TP_fast_assign(
+        __assign_str(dev, dev_name(dev));
+        __entry->page = t->page;
+        __entry->offset = t->offset;
+        __entry->count = t->count;
+        __entry->write = t->write;
+        __entry->result = t->result;
+        __entry->crc = crc;
+    ),
+
+    TP_printk("%s %s page=%u offset=%u count=%u result=%d crc=%s",
+        __get_str(dev), __entry->write ? "write" : "read",
+        __entry->page, __entry->offset, __entry->count, __entry->result,
+        __print_symbolic(__entry->crc,
+            { RCIO_PACKET_CRC_UNCHECKED, "unchecked" },
+            { RCIO_PACKET_CRC_OK, "ok" },
+            { RCIO_PACKET_CRC_BAD, "bad" }))
+);
+
+TRACE_EVENT(rcio_subsystem_start,
+
+    TP_PROTO(const struct rcio_state *state, const struct rcio_subsystem *subsystem, bool periodic),
+
+    TP_ARGS(state, subsystem, periodic),
+
+    TP_STRUCT__entry(
+        __string(board, state->name)
+        __string(subsystem, subsystem->name)
+        __field(bool, periodic)
+    ),
+
+    TP_fast_assign(
+        __assign_str(board, state->name);
+        __assign_str(subsystem, subsystem->name);
+        __entry->periodic = periodic;
+    ),
+
+    TP_printk("%s %s %s", __get_str(board), __get_str(subsystem),
+        __entry->periodic ? "periodic" : "kicked")
+);
+
+TRACE_EVENT(rcio_subsystem_end,
+
+    TP_PROTO(const struct rcio_state *state, const struct rcio_subsystem *subsystem, bool updated),
+
+    TP_ARGS(state, subsystem, updated),
+
+    TP_STRUCT__entry(
+        __string(board, state->name)
+        __string(subsystem, subsystem->name)
+        __field(bool, updated)
+    ),
+
+    TP_fast_assign(
+        __assign_str(board, state->name);
+        __assign_str(subsystem, subsystem->name);
+        __entry->updated = updated;
+    ),
+
+    TP_printk("%s %s updated=%d", __get_str(board), __get_str(subsystem), __entry->updated)
+);
+
+/* one pass over the subsystems, wakeup is when the worker sleeps until */
+TRACE_EVENT(rcio_worker_cycle,
+
+    TP_PROTO(const struct rcio_state *state, bool updated, ktime_t wakeup),
+
+    TP_ARGS(state, updated, wakeup),
+
+    TP_STRUCT__entry(
+        __string(board, state->name)
+        __field(bool, updated)
+        __field(s64, wakeup)
+    ),
+
+    TP_fast_assign(
+        __assign_str(board, state->name);
+        __entry->updated = updated;
+        __entry->wakeup = ktime_to_ns(wakeup);
+    ),
+
+    TP_printk("%s updated=%d wakeup=%lld", __get_str(board), __entry->updated, __entry->wakeup)
+);
+
+#endif /* _RCIO_TRACE_H */
+
+/* the Makefile puts the source directory on the include path */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE rcio_trace
+#include <trace/define_trace.h>
@@ -0,0 +1,126 @@
+#ifndef _RCIO_UAPI_H
+#define _RCIO_UAPI_H
+
+/*
+ * Interface of /dev/rcio, shared with userspace. A second board shows up
+ * as /dev/rcio1 and so on, each with its own telemetry page.
+ *
+ * mmap() of the first page gives struct rcio_telemetry, read only. Every
+ * block has its own producer and sequence counter. The counter is odd
+ * while the block is being written, so a reader copies a block like this:
+ *
+ *     do {
+ *         while ((seq = __atomic_load_n(&block->sequence, __ATOMIC_ACQUIRE)) & 1)
+ *             ;
+ *         copy = *block;
+ *         __atomic_thread_fence(__ATOMIC_ACQUIRE);
+ *     } while (__atomic_load_n(&block->sequence, __ATOMIC_RELAXED) != seq);
+ *
+ * Timestamps are CLOCK_MONOTONIC nanoseconds of the moment the sample
+ * arrived from IO. The rc block only changes when IO has decoded a new
+ * frame, the adc block when a sample differs from the previous one.
+ *
+ * read() returns whole struct rcio_rc_frame records, one per RC frame
+ * IO decoded, oldest first. Every open file has its own position, which
+ * starts at the newest frame. It blocks without O_NONBLOCK. A reader
+ * that falls more than RCIO_RC_RING_FRAMES behind skips ahead. Gaps of
+ * any origin show up as a jump in frame_count.
+ *
+ * poll() reports POLLIN while frames are waiting, so read() won't block.
+ * It reports POLLPRI while the rc or adc block changed since the last
+ * read() on the same open file, which clears it even when it fails with
+ * -EAGAIN. The mmap'ed blocks are then worth copying again.
+ *
+ * RCIO_IOC_SET_PWM replaces all PWM outputs in one frame update and
+ * needs the device open for writing.
+ */
+
+#include <linux/ioctl.h>
+#include <linux/types.h>
+
+#define RCIO_TELEMETRY_VERSION 1
+
+#define RCIO_TELEMETRY_RC_CHANNELS 18
+#define RCIO_TELEMETRY_ADC_CHANNELS 6
+
+struct rcio_telemetry_rc {
+    __u32 sequence;
+    __u32 channel_count;
+    __u64 timestamp_ns;
+    __u16 values[RCIO_TELEMETRY_RC_CHANNELS];
+    /* enum RC_INPUT_SOURCE */
+    __u8 source;
+    __u8 connected;
+    /* wrapping counters kept by IO */
+    __u16 frame_count;
+    __u16 lost_frame_count;
+    __u8 reserved[6];
+};
+
+struct rcio_telemetry_adc {
+    __u32 sequence;
+    __u32 reserved;
+    __u64 timestamp_ns;
+    /* as read from PX4IO_PAGE_RAW_ADC_INPUT */
+    __u16 values[RCIO_TELEMETRY_ADC_CHANNELS];
+    __u8 reserved2[4];
+};
+
+struct rcio_telemetry_status {
+    __u32 sequence;
+    __u32 reserved;
+    __u64 timestamp_ns;
+    /* PX4IO_P_STATUS_FLAGS and PX4IO_P_STATUS_ALARMS as read from IO */
+    __u16 flags;
+    __u16 alarms;
+    __u8 init_ok;
+    __u8 pwm_ok;
+    __u8 alive;
+    __u8 reserved2;
+};
+
+#define RCIO_RC_RING_FRAMES 256
+
+struct rcio_rc_frame {
+    __u64 timestamp_ns;
+    /* PX4IO_P_RAW_FRAME_COUNT and PX4IO_P_RAW_LOST_FRAME_COUNT */
+    __u16 frame_count;
+    __u16 lost_frame_count;
+    /* PX4IO_P_RAW_RC_COUNT, PX4IO_P_RAW_RC_FLAGS and PX4IO_P_RAW_RC_NRSSI */
+    __u16 channel_count;
+    __u16 flags;
+    __u16 rssi;
+    __u16 reserved;
+    /* as received, not range checked */
+    __u16 values[RCIO_TELEMETRY_RC_CHANNELS];
+};
+
+struct rcio_telemetry {
+    __u32 version;
+    /* sizeof(struct rcio_telemetry) of the running driver */
+    __u32 size;
+
+    struct rcio_telemetry_rc rc;
+    struct rcio_telemetry_adc adc;
+    struct rcio_telemetry_status status;
+};
+
+#define RCIO_PWM_CHANNELS 14
+
+/* return once the frame is on IO, -EAGAIN while the outputs are disarmed or -ETIMEDOUT */
+#define RCIO_PWM_FRAME_FLUSH (1 << 0)
+
+/* a channel is 0 for no pulses or within these, as PX4 limits PWM, anything else is -EINVAL */
+#define RCIO_PWM_MIN_US 90
+#define RCIO_PWM_MAX_US 2500
+
+struct rcio_pwm_values {
+    __u32 flags;
+    /* microseconds */
+    __u16 values[RCIO_PWM_CHANNELS];
+};
+
+#define RCIO_IOC_MAGIC 'R'
+#define RCIO_IOC_SET_PWM _IOW(RCIO_IOC_MAGIC, 1, struct rcio_pwm_values)
+
+#endif /* _RCIO_UAPI_H */